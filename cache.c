@@ -0,0 +1,501 @@
+//
+// cache.c - persistent cache of partition maps read from image files
+//
+// Listing an unchanged image should not cost any reads of the image.
+// When a cache file is given, every map read for a listing or in
+// read-only mode is appended to it as the raw block zero and map
+// blocks, keyed by the image's device, inode, size and modification
+// time.  Trailing zero bytes of each block are dropped, which shrinks
+// a typical entry from 512 bytes to about 150.  An XXH64 hash of the
+// raw blocks is kept so a hit can be checked against the medium on
+// demand (--verify-cache).
+//
+// Block devices are never cached; a different card in the same reader
+// has the same inode and timestamp.
+//
+// File layout: a cache_file_header, then cache_records, each followed
+// by its packed blocks (a 16 bit length and that many bytes per block).
+// All numbers are in host order; the file is not meant to be shared
+// between machines.  A newer record for the same file supersedes an
+// older one and the file is rewritten when stale records dominate.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "hash.h"
+#include "cache.h"
+
+
+//
+// Defines
+//
+#define CACHE_MAGIC	0x48464443	/* 'HFDC' */
+#define CACHE_VERSION	1
+#define CACHE_BUCKETS	4096		/* grows by doubling */
+
+
+//
+// Types
+//
+struct cache_file_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct cache_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+struct cache_record {
+    struct cache_key key;
+    uint64_t hash;		/* hash64() of the raw blocks */
+    uint32_t count;		/* block zero plus map blocks */
+    uint32_t bytes;		/* size of the packed blocks that follow */
+};
+
+struct cache_entry {
+    struct cache_entry *next;
+    struct cache_record rec;
+    unsigned char *packed;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+char *cache_file;
+int verify_cache;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry **buckets;
+static unsigned long bucket_count;
+static unsigned long live_entries;
+static int cache_fd = -1;
+static int cache_loaded;
+
+
+//
+// Forward declarations
+//
+struct cache_entry* find_cache_entry(struct cache_key *key);
+int get_cache_key(int fd, struct cache_key *key);
+void insert_cache_entry(struct cache_entry *e);
+int load_cache();
+unsigned long key_bucket(struct cache_key *key, unsigned long n);
+unsigned char* pack_blocks(char *blocks, long count, uint32_t *bytes);
+void rewrite_cache();
+char* unpack_blocks(struct cache_entry *e);
+
+
+//
+// Routines
+//
+int
+get_cache_key(int fd, struct cache_key *key)
+{
+    struct stat info;
+
+    if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+	return 0;
+    }
+    memset(key, 0, sizeof(*key));
+    key->dev = info.st_dev;
+    key->ino = info.st_ino;
+    key->size = info.st_size;
+    key->mtime_sec = info.st_mtim.tv_sec;
+    key->mtime_nsec = info.st_mtim.tv_nsec;
+    return 1;
+}
+
+
+unsigned long
+key_bucket(struct cache_key *key, unsigned long n)
+{
+    return hash64(key, 2 * sizeof(uint64_t), 0) & (n - 1);
+}
+
+
+struct cache_entry *
+find_cache_entry(struct cache_key *key)
+{
+    struct cache_entry *e;
+
+    if (buckets == NULL) {
+	return NULL;
+    }
+    for (e = buckets[key_bucket(key, bucket_count)]; e != NULL; e = e->next) {
+	if (e->rec.key.dev == key->dev && e->rec.key.ino == key->ino) {
+	    return e;
+	}
+    }
+    return NULL;
+}
+
+
+//
+// Add e, replacing (and freeing) any entry for the same file.
+//
+void
+insert_cache_entry(struct cache_entry *e)
+{
+    struct cache_entry **pp;
+    struct cache_entry **nb;
+    struct cache_entry *p;
+    struct cache_entry *next;
+    unsigned long n;
+    unsigned long i;
+
+    if (buckets == NULL || live_entries >= bucket_count) {
+	n = (bucket_count == 0)? CACHE_BUCKETS: bucket_count * 2;
+	nb = (struct cache_entry **) calloc(n, sizeof(struct cache_entry *));
+	if (nb == NULL) {
+	    if (buckets == NULL) {
+		free(e->packed);
+		free(e);
+		return;
+	    }
+	} else {
+	    for (i = 0; i < bucket_count; i++) {
+		for (p = buckets[i]; p != NULL; p = next) {
+		    next = p->next;
+		    p->next = nb[key_bucket(&p->rec.key, n)];
+		    nb[key_bucket(&p->rec.key, n)] = p;
+		}
+	    }
+	    free(buckets);
+	    buckets = nb;
+	    bucket_count = n;
+	}
+    }
+
+    for (pp = &buckets[key_bucket(&e->rec.key, bucket_count)]; *pp != NULL;
+	    pp = &(*pp)->next) {
+	if ((*pp)->rec.key.dev == e->rec.key.dev
+		&& (*pp)->rec.key.ino == e->rec.key.ino) {
+	    p = *pp;
+	    e->next = p->next;
+	    *pp = e;
+	    free(p->packed);
+	    free(p);
+	    return;
+	}
+    }
+    e->next = buckets[key_bucket(&e->rec.key, bucket_count)];
+    buckets[key_bucket(&e->rec.key, bucket_count)] = e;
+    live_entries++;
+}
+
+
+//
+// Read the whole cache into the table, then leave the file open for
+// appending.  Anything after the last good record, such as a record
+// torn by an interrupted append, is cut off first so that new records
+// don't land behind it.  Returns 0 if there is no usable cache.
+//
+int
+load_cache()
+{
+    struct cache_file_header header;
+    struct cache_record rec;
+    struct cache_entry *e;
+    unsigned long records;
+    off_t good;
+    ssize_t t;
+    int fd;
+
+    if (cache_loaded) {
+	return cache_fd >= 0;
+    }
+    cache_loaded = 1;
+
+    fd = open(cache_file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+	error(errno, "can't open cache file '%s'", cache_file);
+	return 0;
+    }
+    t = read(fd, &header, sizeof(header));
+    if (t == 0) {
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+	    error(errno, "can't write cache file '%s'", cache_file);
+	    close(fd);
+	    return 0;
+	}
+    } else if (t != sizeof(header) || header.magic != CACHE_MAGIC
+	    || header.version != CACHE_VERSION) {
+	error(-1, "'%s' is not a partition map cache", cache_file);
+	close(fd);
+	return 0;
+    }
+
+    records = 0;
+    good = sizeof(header);
+    while (read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+	if (rec.count < 2
+		|| rec.bytes > (uint64_t) rec.count * (PBLOCK_SIZE + 2)) {
+	    break;
+	}
+	e = (struct cache_entry *) malloc(sizeof(struct cache_entry));
+	if (e == NULL) {
+	    break;
+	}
+	e->rec = rec;
+	e->packed = (unsigned char *) malloc(rec.bytes);
+	if (e->packed == NULL
+		|| read(fd, e->packed, rec.bytes) != (ssize_t) rec.bytes) {
+	    // torn record from an interrupted append
+	    free(e->packed);
+	    free(e);
+	    break;
+	}
+	insert_cache_entry(e);
+	records++;
+	good += sizeof(rec) + rec.bytes;
+    }
+    if (lseek(fd, 0, SEEK_END) > good && ftruncate(fd, good) < 0) {
+	error(errno, "can't truncate cache file '%s'", cache_file);
+	close(fd);
+	return 0;
+    }
+    cache_fd = fd;
+
+    if (records > 64 && records > 2 * live_entries) {
+	rewrite_cache();
+    }
+    lseek(cache_fd, 0, SEEK_END);
+    return cache_fd >= 0;
+}
+
+
+//
+// Replace the cache file with just the live entries.
+//
+void
+rewrite_cache()
+{
+    struct cache_file_header header;
+    struct cache_entry *e;
+    char *name;
+    unsigned long i;
+    int fd;
+    int ok;
+
+    name = (char *) malloc(strlen(cache_file) + 5);
+    if (name == NULL) {
+	return;
+    }
+    sprintf(name, "%s.new", cache_file);
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	free(name);
+	return;
+    }
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    ok = (write(fd, &header, sizeof(header)) == sizeof(header));
+    for (i = 0; ok && i < bucket_count; i++) {
+	for (e = buckets[i]; ok && e != NULL; e = e->next) {
+	    ok = (write(fd, &e->rec, sizeof(e->rec)) == sizeof(e->rec)
+		    && write(fd, e->packed, e->rec.bytes)
+			== (ssize_t) e->rec.bytes);
+	}
+    }
+    if (close(fd) < 0 || !ok || rename(name, cache_file) < 0) {
+	unlink(name);
+    } else {
+	close(cache_fd);
+	cache_fd = open(cache_file, O_RDWR);
+    }
+    free(name);
+}
+
+
+unsigned char *
+pack_blocks(char *blocks, long count, uint32_t *bytes)
+{
+    unsigned char *packed;
+    unsigned char *p;
+    char *b;
+    uint16_t len;
+    long i;
+
+    packed = (unsigned char *) malloc(count * (PBLOCK_SIZE + 2));
+    if (packed == NULL) {
+	return NULL;
+    }
+    p = packed;
+    for (i = 0; i < count; i++) {
+	b = blocks + i * PBLOCK_SIZE;
+	for (len = PBLOCK_SIZE; len > 0 && b[len - 1] == 0; len--) {
+	}
+	memcpy(p, &len, 2);
+	memcpy(p + 2, b, len);
+	p += 2 + len;
+    }
+    *bytes = p - packed;
+    return packed;
+}
+
+
+char *
+unpack_blocks(struct cache_entry *e)
+{
+    char *blocks;
+    unsigned char *p;
+    unsigned char *end;
+    uint16_t len;
+    uint32_t i;
+
+    blocks = (char *) calloc(e->rec.count, PBLOCK_SIZE);
+    if (blocks == NULL) {
+	return NULL;
+    }
+    p = e->packed;
+    end = p + e->rec.bytes;
+    for (i = 0; i < e->rec.count; i++) {
+	if (p + 2 > end) {
+	    break;
+	}
+	memcpy(&len, p, 2);
+	if (len > PBLOCK_SIZE || p + 2 + len > end) {
+	    break;
+	}
+	memcpy(blocks + i * PBLOCK_SIZE, p + 2, len);
+	p += 2 + len;
+    }
+    if (i < e->rec.count) {
+	free(blocks);
+	return NULL;
+    }
+    return blocks;
+}
+
+
+//
+// Fill in the map from the cache if this file is in it unchanged.
+// Returns 1 on a hit; on a miss the caller reads the medium as usual.
+//
+int
+lookup_map_cache(partition_map_header *map)
+{
+    struct cache_key key;
+    struct cache_entry *e;
+    char *blocks;
+    char *raw;
+    uint32_t count;
+    uint64_t hash;
+    int result = 0;
+
+    if (cache_file == NULL || !(rflag || lflag)
+	    || !get_cache_key(map->fd, &key)) {
+	return 0;
+    }
+    pthread_mutex_lock(&cache_lock);
+    blocks = NULL;
+    if (load_cache() && (e = find_cache_entry(&key)) != NULL
+	    && memcmp(&e->rec.key, &key, sizeof(key)) == 0) {
+	blocks = unpack_blocks(e);
+	hash = e->rec.hash;
+	count = e->rec.count;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (blocks == NULL) {
+	return 0;
+    }
+
+    if (verify_cache) {
+	raw = (char *) malloc(count * PBLOCK_SIZE);
+	if (raw == NULL || read_blocks(map->fd, 0, raw, count, 1) == 0
+		|| hash64(raw, count * PBLOCK_SIZE, 0) != hash) {
+	    error(-1, "cached map of '%s' does not match the medium", map->name);
+	    free(raw);
+	    free(blocks);
+	    return 0;
+	}
+	free(raw);
+    }
+    if (load_partition_map(map, blocks, count) == 0) {
+	result = 1;
+    } else {
+	// throw away whatever was half built and read it for real
+	clear_partition_map(map);
+    }
+    free(blocks);
+    return result;
+}
+
+
+//
+// Remember the raw blocks just read for this map.
+//
+void
+store_map_cache(partition_map_header *map, char *blocks, long count)
+{
+    struct cache_key key;
+    struct cache_entry *e;
+    char *record;
+    size_t len;
+
+    if (cache_file == NULL || !(rflag || lflag)
+	    || !get_cache_key(map->fd, &key)) {
+	return;
+    }
+    e = (struct cache_entry *) malloc(sizeof(struct cache_entry));
+    if (e == NULL) {
+	return;
+    }
+    memset(&e->rec, 0, sizeof(e->rec));
+    e->rec.key = key;
+    e->rec.hash = hash64(blocks, count * PBLOCK_SIZE, 0);
+    e->rec.count = count;
+    e->packed = pack_blocks(blocks, count, &e->rec.bytes);
+    if (e->packed == NULL) {
+	free(e);
+	return;
+    }
+
+	// one write per record so a crash can only tear the last one
+    len = sizeof(e->rec) + e->rec.bytes;
+    record = (char *) malloc(len);
+    if (record == NULL) {
+	free(e->packed);
+	free(e);
+	return;
+    }
+    memcpy(record, &e->rec, sizeof(e->rec));
+    memcpy(record + sizeof(e->rec), e->packed, e->rec.bytes);
+
+    pthread_mutex_lock(&cache_lock);
+    if (load_cache()) {
+	if (write(cache_fd, record, len) != (ssize_t) len) {
+	    error(errno, "can't write cache file '%s'", cache_file);
+	}
+	insert_cache_entry(e);
+    } else {
+	free(e->packed);
+	free(e);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(record);
+}
@@ -0,0 +1,32 @@
+//
+// cache.h - persistent cache of partition maps read from image files
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+extern char *cache_file;
+extern int verify_cache;
+
+
+//
+// Forward declarations
+//
+int lookup_map_cache(partition_map_header *map);
+void store_map_cache(partition_map_header *map, char *blocks, long count);
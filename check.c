@@ -0,0 +1,382 @@
+//
+// check.c - consistency checks of a partition map
+//
+// The map is read leniently (an entry count that disagrees with the
+// first entry is reported, not fatal) and never written.  The entries
+// are sorted by base once; overlaps, gaps and extents past the end of
+// the medium all fall out of a single pass over the sorted list, and
+// each driver descriptor in block zero is located by binary search.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "convert.h"
+#include "output.h"
+#include "check.h"
+
+
+//
+// Defines
+//
+#define CHECK_CHUNK	64		/* map blocks per read */
+#define MAX_DRIVERS	(sizeof(((Block0 *)0)->sbMap) / sizeof(DDMap))
+
+
+//
+// Types
+//
+struct check_entry {
+    long index;
+    uint32_t start;
+    uint32_t length;
+    int driver;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+long issue_count;
+
+
+//
+// Forward declarations
+//
+int compare_check_entries(const void *a, const void *b);
+void check_drivers(output_buffer *ob, char *name, Block0 *zero,
+	struct check_entry *list, long count);
+void check_extents(output_buffer *ob, char *name, struct check_entry *list,
+	long count, uint32_t media_size);
+long read_check_entries(output_buffer *ob, char *name, int fd,
+	uint32_t media_size, struct check_entry **list);
+
+
+//
+// Routines
+//
+
+//
+// Report one problem with the map on name.  index is the map entry
+// concerned, or 0 for block zero.
+//
+void
+report_issue(output_buffer *ob, const char *name, const char *kind,
+	long index, const char *fmt, ...)
+{
+    va_list ap;
+    char message[256];
+
+    va_start(ap, fmt);
+    vsnprintf(message, sizeof(message), fmt, ap);
+    va_end(ap);
+
+    __sync_fetch_and_add(&issue_count, 1);
+    if (output_format == kTextFormat) {
+	out_printf(ob, "%s: ", name);
+	if (index > 0) {
+	    out_printf(ob, "entry %ld: ", index);
+	}
+	out_printf(ob, "%s (%s)\n", message, kind);
+    } else {
+	out_begin_record(ob, "issue");
+	out_text_field(ob, "device", name, strlen(name));
+	out_text_field(ob, "kind", kind, strlen(kind));
+	out_number_field(ob, "index", index);
+	out_text_field(ob, "message", message, strlen(message));
+	out_end_record(ob);
+    }
+}
+
+
+int
+compare_check_entries(const void *a, const void *b)
+{
+    const struct check_entry *x = (const struct check_entry *) a;
+    const struct check_entry *y = (const struct check_entry *) b;
+
+    if (x->start != y->start) {
+	return (x->start < y->start)? -1: 1;
+    }
+    if (x->length != y->length) {
+	return (x->length < y->length)? -1: 1;
+    }
+    return (x->index < y->index)? -1: (x->index > y->index);
+}
+
+
+//
+// Read every map block the first entry claims, plus the one after it,
+// and keep the extents.  The map is read CHECK_CHUNK blocks at a time
+// and reading stops at the first block that isn't an entry, so a wild
+// entry count costs no more than the map really holds.  Returns the
+// number of entries, or -1 if there is no map to speak of.
+//
+long
+read_check_entries(output_buffer *ob, char *name, int fd,
+	uint32_t media_size, struct check_entry **list)
+{
+    struct check_entry *p;
+    char *buf;
+    DPME *data;
+    uint32_t limit;
+    uint32_t last;
+    long count;
+    long size;
+    long chunk;
+    long i;
+
+    *list = NULL;
+    buf = (char *) malloc(CHECK_CHUNK * PBLOCK_SIZE);
+    if (buf == NULL) {
+	error(errno, "can't allocate memory for disk buffers");
+	return -1;
+    }
+    if (media_size < 2 || read_blocks(fd, 1, buf, 1, 0) == 0) {
+	report_issue(ob, name, "no_map", 0, "can't read block 1");
+	free(buf);
+	return -1;
+    }
+    data = (DPME *) buf;
+    convert_dpme(data, 1);
+    if (data->dpme_signature != DPME_SIGNATURE) {
+	report_issue(ob, name, "no_map", 0, "block 1 is not a map entry");
+	free(buf);
+	return -1;
+    }
+    limit = data->dpme_map_entries;
+    if (limit < 1 || limit >= media_size) {
+	report_issue(ob, name, "map_entries", 1,
+		"map claims %u entries on a medium of %u blocks",
+		limit, media_size);
+    }
+	// one extra block to catch entries past the claimed end
+    last = (limit < media_size - 1)? limit + 1: media_size - 1;
+
+    count = 0;
+    size = 0;
+    for (i = 1; i <= last; i++) {
+	chunk = (i - 1) % CHECK_CHUNK;
+	if (chunk == 0) {
+	    chunk = last - i + 1;
+	    if (chunk > CHECK_CHUNK) {
+		chunk = CHECK_CHUNK;
+	    }
+	    if (read_blocks(fd, i, buf, chunk, 0) == 0) {
+		report_issue(ob, name, "unreadable", i,
+			"can't read map block %ld", i);
+		break;
+	    }
+	    chunk = 0;
+	}
+	data = (DPME *) (buf + chunk * PBLOCK_SIZE);
+	convert_dpme(data, 1);
+	if (data->dpme_signature != DPME_SIGNATURE) {
+	    if (i <= limit) {
+		report_issue(ob, name, "bad_signature", i,
+			"block %ld is not a map entry but the map claims %u",
+			i, limit);
+	    }
+	    break;
+	}
+	if (i > limit) {
+	    report_issue(ob, name, "map_entries", i,
+		    "map entry follows the %u the map claims", limit);
+	    break;
+	}
+	if (data->dpme_map_entries != limit) {
+	    report_issue(ob, name, "map_entries", i,
+		    "claims %u entries, entry 1 claims %u",
+		    data->dpme_map_entries, limit);
+	}
+	if (count >= size) {
+	    size = (size == 0)? CHECK_CHUNK: size * 2;
+	    p = (struct check_entry *) realloc(*list,
+		    size * sizeof(struct check_entry));
+	    if (p == NULL) {
+		error(errno, "can't allocate memory for map entries");
+		break;
+	    }
+	    *list = p;
+	}
+	(*list)[count].index = i;
+	(*list)[count].start = data->dpme_pblock_start;
+	(*list)[count].length = data->dpme_pblocks;
+	(*list)[count].driver = (strstr(data->dpme_type, "Driver") != NULL);
+	count++;
+    }
+    free(buf);
+    return count;
+}
+
+
+//
+// list is sorted by base.  Everything from block 1 to the end of the
+// medium should belong to exactly one entry.
+//
+void
+check_extents(output_buffer *ob, char *name, struct check_entry *list,
+	long count, uint32_t media_size)
+{
+    uint64_t covered;
+    uint64_t end;
+    long owner;
+    long i;
+
+    covered = 1;
+    owner = 0;
+    for (i = 0; i < count; i++) {
+	if (list[i].length == 0) {
+	    continue;
+	}
+	end = (uint64_t) list[i].start + list[i].length;
+	if (end > media_size) {
+	    report_issue(ob, name, "past_end", list[i].index,
+		    "blocks %u to %llu are past the end of the medium (%u)",
+		    list[i].start, (unsigned long long) end - 1, media_size);
+	}
+	if (list[i].start < covered && owner > 0) {
+	    report_issue(ob, name, "overlap", list[i].index,
+		    "overlaps entry %ld at block %u", owner, list[i].start);
+	} else if (list[i].start > covered) {
+	    report_issue(ob, name, "gap", list[i].index,
+		    "blocks %llu to %u before it belong to no entry",
+		    (unsigned long long) covered, list[i].start - 1);
+	}
+	if (end > covered) {
+	    covered = end;
+	    owner = list[i].index;
+	}
+    }
+    if (covered < media_size) {
+	report_issue(ob, name, "gap", 0,
+		"blocks %llu to %u at the end belong to no entry",
+		(unsigned long long) covered, media_size - 1);
+    }
+}
+
+
+//
+// Every driver descriptor in block zero should lie inside a driver
+// partition.
+//
+void
+check_drivers(output_buffer *ob, char *name, Block0 *zero,
+	struct check_entry *list, long count)
+{
+    DDMap *m;
+    long lo;
+    long hi;
+    long mid;
+    int drivers;
+    int i;
+
+    if (zero->sbSig != BLOCK0_SIGNATURE) {
+	return;
+    }
+    drivers = zero->sbDrvrCount;
+    if (drivers > MAX_DRIVERS) {
+	report_issue(ob, name, "driver_count", 0,
+		"block zero claims %d drivers, it has room for %d",
+		drivers, (int) MAX_DRIVERS);
+	drivers = MAX_DRIVERS;
+    }
+    m = (DDMap *) zero->sbMap;
+    for (i = 0; i < drivers; i++) {
+	    // last entry starting at or before the driver
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+	    mid = (lo + hi) / 2;
+	    if (list[mid].start <= m[i].ddBlock) {
+		lo = mid + 1;
+	    } else {
+		hi = mid;
+	    }
+	}
+	lo--;
+	if (lo < 0 || (uint64_t) m[i].ddBlock + m[i].ddSize
+		> (uint64_t) list[lo].start + list[lo].length) {
+	    report_issue(ob, name, "driver", 0,
+		    "driver %d at block %u for %u is not inside a partition",
+		    i + 1, m[i].ddBlock, m[i].ddSize);
+	} else if (!list[lo].driver) {
+	    report_issue(ob, name, "driver", list[lo].index,
+		    "driver %d at block %u is not in a driver partition",
+		    i + 1, m[i].ddBlock);
+	}
+    }
+}
+
+
+//
+// Check the map on name and report every problem found.  Returns the
+// number of problems, or -1 if name can't be read at all.
+//
+long
+check_partition_map(char *name)
+{
+    output_buffer *ob;
+    struct check_entry *list;
+    Block0 *zero;
+    uint32_t media_size;
+    long before;
+    long count;
+    long result;
+    int fd;
+
+    ob = standard_output();
+    fd = open_device(name, O_RDONLY);
+    if (fd < 0) {
+	error(errno, "can't open file '%s'", name);
+	return -1;
+    }
+    zero = (Block0 *) malloc(PBLOCK_SIZE);
+    if (zero == NULL) {
+	error(errno, "can't allocate memory for block zero buffer");
+	close_device(fd);
+	return -1;
+    }
+    before = issue_count;
+    media_size = compute_device_size(fd);
+    if (read_blocks(fd, 0, (char *) zero, 1, 0) == 0) {
+	free(zero);
+	close_device(fd);
+	return -1;
+    }
+    convert_block0(zero, 1);
+
+    count = read_check_entries(ob, name, fd, media_size, &list);
+    if (count >= 0) {
+	qsort(list, count, sizeof(struct check_entry), compare_check_entries);
+	check_extents(ob, name, list, count, media_size);
+	check_drivers(ob, name, zero, list, count);
+	free(list);
+    }
+    if (count < 0 && issue_count == before) {
+	result = -1;
+    } else {
+	result = issue_count - before;
+	if (result == 0 && output_format == kTextFormat) {
+	    out_printf(ob, "%s: no problems found\n", name);
+	}
+    }
+    flush_output(ob);
+
+    free(zero);
+    close_device(fd);
+    return result;
+}
@@ -0,0 +1,39 @@
+//
+// check.h - consistency checks of a partition map
+//
+#ifndef check_h
+#define check_h
+
+#include "output.h"
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+extern long issue_count;
+
+
+//
+// Forward declarations
+//
+long check_partition_map(char *name);
+void report_issue(output_buffer *ob, const char *name, const char *kind,
+	long index, const char *fmt, ...)
+	__attribute__((format(printf, 5, 6)));
+
+#endif
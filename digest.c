@@ -0,0 +1,312 @@
+//
+// digest.c - hash the contents of partitions
+//
+// Every allocated partition is cut into DIGEST_CHUNK pieces and the
+// pieces are handed to the thread pool, so a few large partitions keep
+// every worker busy and each read is one large sequential transfer.
+// A piece is hashed as it is read; a partition's hash is the hash of
+// its pieces' hashes, and the image's hash is the hash of block zero's
+// and every partition's extent and hash.  Free space is never read.
+//
+// These are XXH64 hashes of hashes, so they only compare with other
+// hfdisk --hash output, not with an XXH64 of the raw partition.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "output.h"
+#include "pool.h"
+#include "hash.h"
+#include "digest.h"
+
+
+//
+// Defines
+//
+#define DIGEST_CHUNK	16384		/* blocks per piece (8MB) */
+
+
+//
+// Types
+//
+struct digest_extent {
+    partition_map *entry;	// NULL for block zero
+    uint32_t start;
+    uint32_t length;
+    long first;			// its first piece
+    long pieces;
+    uint64_t hash;
+};
+
+struct digest_piece {
+    uint32_t start;
+    uint32_t length;
+    uint64_t hash;		// little endian, ready to be hashed again
+};
+
+struct digest_job {
+    int fd;
+    char *name;
+    struct digest_piece *pieces;
+    char **buffers;
+    long failed;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int collect_extents(partition_map_header *map, struct digest_extent **list);
+void hash_piece(long task, int worker, void *arg);
+int hash_image(char *name, int workers, output_buffer *ob);
+void report_hash(output_buffer *ob, char *name, struct digest_extent *e);
+
+
+//
+// Routines
+//
+
+//
+// Block zero and every partition that is not free, in base order,
+// clipped to the medium.  Returns the count, or -1.
+//
+int
+collect_extents(partition_map_header *map, struct digest_extent **list)
+{
+    partition_map * entry;
+    struct digest_extent *e;
+    uint64_t end;
+    int count;
+
+    count = 1;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	count++;
+    }
+    *list = (struct digest_extent *) calloc(count, sizeof(struct digest_extent));
+    if (*list == NULL) {
+	error(errno, "can't allocate memory for extent list");
+	return -1;
+    }
+    e = *list;
+    e->start = 0;
+    e->length = 1;
+    count = 1;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) == 0
+		|| entry->data->dpme_pblock_start >= map->media_size) {
+	    continue;
+	}
+	e = &(*list)[count++];
+	e->entry = entry;
+	e->start = entry->data->dpme_pblock_start;
+	end = (uint64_t) e->start + entry->data->dpme_pblocks;
+	if (end > map->media_size) {
+	    end = map->media_size;
+	}
+	e->length = end - e->start;
+    }
+    return count;
+}
+
+
+void
+hash_piece(long task, int worker, void *arg)
+{
+    struct digest_job *job = (struct digest_job *) arg;
+    struct digest_piece *p = &job->pieces[task];
+    char *buf = job->buffers[worker];
+
+    if (read_blocks(job->fd, p->start, buf, p->length, 0) == 0) {
+	__sync_fetch_and_add(&job->failed, 1);
+	p->hash = 0;
+	return;
+    }
+    p->hash = htole64(hash64(buf, (size_t) p->length * PBLOCK_SIZE, 0));
+}
+
+
+void
+report_hash(output_buffer *ob, char *name, struct digest_extent *e)
+{
+    char text[17];
+
+    if (output_format == kTextFormat) {
+	if (e->entry == NULL) {
+	    out_printf(ob, "%016llx  %s\n", (unsigned long long) e->hash, name);
+	} else {
+	    out_printf(ob, "%016llx  %s%ld\n", (unsigned long long) e->hash,
+		    name, e->entry->disk_address);
+	}
+	return;
+    }
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long) e->hash);
+    if (e->entry == NULL) {
+	out_begin_record(ob, "image_hash");
+	out_text_field(ob, "device", name, strlen(name));
+    } else {
+	out_begin_record(ob, "partition_hash");
+	out_text_field(ob, "device", name, strlen(name));
+	out_number_field(ob, "index", e->entry->disk_address);
+	out_text_field(ob, "type", e->entry->data->dpme_type, DPISTRLEN);
+	out_text_field(ob, "name", e->entry->data->dpme_name, DPISTRLEN);
+	out_number_field(ob, "base", e->start);
+	out_number_field(ob, "length", e->length);
+    }
+    out_text_field(ob, "hash", text, 16);
+    out_end_record(ob);
+}
+
+
+int
+hash_image(char *name, int workers, output_buffer *ob)
+{
+    partition_map_header *map;
+    struct digest_extent *list;
+    struct digest_job job;
+    uint64_t *sums;
+    uint32_t block;
+    long total;
+    long i;
+    long j;
+    int count;
+    int junk;
+    int result;
+
+    map = open_partition_map(name, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    count = collect_extents(map, &list);
+    if (count < 0) {
+	close_partition_map(map);
+	return 0;
+    }
+    total = 0;
+    for (i = 0; i < count; i++) {
+	list[i].first = total;
+	list[i].pieces = (list[i].length + DIGEST_CHUNK - 1) / DIGEST_CHUNK;
+	total += list[i].pieces;
+    }
+    if (workers > total) {
+	workers = total;
+    }
+
+    job.fd = map->fd;
+    job.name = name;
+    job.failed = 0;
+    job.pieces = (struct digest_piece *) malloc(total * sizeof(struct digest_piece));
+    job.buffers = (char **) calloc(workers, sizeof(char *));
+	// room for the pieces of any one extent, or two words per extent
+    sums = (uint64_t *) malloc((total + 2 * count) * sizeof(uint64_t));
+    if (job.pieces == NULL || job.buffers == NULL || sums == NULL) {
+	error(errno, "can't allocate memory for hashing");
+	result = 0;
+	goto done;
+    }
+    for (i = 0; i < workers; i++) {
+	if (posix_memalign((void **)&job.buffers[i], 4096,
+		DIGEST_CHUNK * PBLOCK_SIZE) != 0) {
+	    error(errno, "can't allocate memory for disk buffers");
+	    job.buffers[i] = NULL;
+	    result = 0;
+	    goto done;
+	}
+    }
+    for (i = 0; i < count; i++) {
+	block = list[i].start;
+	for (j = 0; j < list[i].pieces; j++) {
+	    job.pieces[list[i].first + j].start = block;
+	    job.pieces[list[i].first + j].length =
+		    (list[i].start + list[i].length - block < DIGEST_CHUNK)?
+		    list[i].start + list[i].length - block: DIGEST_CHUNK;
+	    block += DIGEST_CHUNK;
+	}
+    }
+
+    if (run_pool(total, workers, hash_piece, &job) == 0) {
+	result = 0;
+	goto done;
+    }
+    if (job.failed > 0) {
+	error(-1, "can't hash '%s', %ld pieces unreadable", name, job.failed);
+	result = 0;
+	goto done;
+    }
+
+	// each extent from its pieces, then the image from the extents
+    for (i = 0; i < count; i++) {
+	for (j = 0; j < list[i].pieces; j++) {
+	    sums[j] = job.pieces[list[i].first + j].hash;
+	}
+	list[i].hash = hash64(sums, list[i].pieces * sizeof(uint64_t), 0);
+    }
+    for (i = 0; i < count; i++) {
+	sums[2 * i] = htole64(((uint64_t) list[i].start << 32) | list[i].length);
+	sums[2 * i + 1] = htole64(list[i].hash);
+    }
+	// block zero is done with, so its slot now holds the image's hash
+    list[0].hash = hash64(sums, 2 * count * sizeof(uint64_t), 0);
+
+    for (i = 1; i < count; i++) {
+	report_hash(ob, name, &list[i]);
+    }
+    report_hash(ob, name, &list[0]);
+    result = 1;
+
+done:
+    if (job.buffers != NULL) {
+	for (i = 0; i < workers; i++) {
+	    free(job.buffers[i]);
+	}
+    }
+    free(job.buffers);
+    free(job.pieces);
+    free(sums);
+    free(list);
+    close_partition_map(map);
+    return result;
+}
+
+
+//
+// Hash every allocated partition of each named image on up to workers
+// threads.  Returns 1 if all of them could be hashed.
+//
+int
+hash_partitions(char **names, int count, int workers)
+{
+    output_buffer *ob;
+    int result;
+    int i;
+
+    if (workers <= 0) {
+	workers = default_pool_size();
+    }
+    ob = standard_output();
+    result = 1;
+    for (i = 0; i < count; i++) {
+	if (hash_image(names[i], workers, ob) == 0) {
+	    result = 0;
+	}
+	flush_output(ob);
+    }
+    return result;
+}
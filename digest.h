@@ -0,0 +1,29 @@
+//
+// digest.h - hash the contents of partitions
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int hash_partitions(char **names, int count, int workers);
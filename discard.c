@@ -0,0 +1,223 @@
+//
+// discard.c - give the blocks of deleted partitions back to the medium
+//
+// Deleting a partition only rewrites the map; its old contents stay
+// where they were.  With --discard the allocated extents are noted when
+// the map is opened, and after the map is written every block that was
+// allocated then and is free now is discarded: BLKDISCARD on a device,
+// a punched hole in an image file.  Neighbouring ranges are merged so
+// each run of freed blocks costs one call.
+//
+// A discarded block on a device may read back as anything, so blocks
+// that must read as zero are cleared with BLKZEROOUT instead.
+//
+
+#define _GNU_SOURCE	// for fallocate
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "discard.h"
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+int discard_flag;
+
+
+//
+// Forward declarations
+//
+
+
+//
+// Routines
+//
+
+//
+// Note every extent that is not free, in base order.
+//
+void
+snapshot_allocated(partition_map_header *map)
+{
+    partition_map * entry;
+    int count;
+
+    free(map->allocated);
+    map->allocated = NULL;
+    map->allocated_count = 0;
+
+    count = 0;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	count++;
+    }
+    if (count == 0) {
+	return;
+    }
+    map->allocated = (struct extent *) malloc(count * sizeof(struct extent));
+    if (map->allocated == NULL) {
+	error(errno, "can't allocate memory for extent list");
+	return;
+    }
+    count = 0;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) != 0) {
+	    map->allocated[count].start = entry->data->dpme_pblock_start;
+	    map->allocated[count].length = entry->data->dpme_pblocks;
+	    count++;
+	}
+    }
+    map->allocated_count = count;
+}
+
+
+int
+discard_blocks(int fd, int regular_file, uint64_t start, uint64_t count)
+{
+    uint64_t range[2];
+
+    range[0] = start * PBLOCK_SIZE;
+    range[1] = count * PBLOCK_SIZE;
+    if (regular_file) {
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		range[0], range[1]) < 0) {
+	    return 0;
+	}
+    } else if (ioctl(fd, BLKDISCARD, range) < 0) {
+	return 0;
+    }
+    return 1;
+}
+
+
+//
+// Make count blocks read as zero without sending the zeros.
+//
+int
+zero_blocks(int fd, int regular_file, uint64_t start, uint64_t count)
+{
+    uint64_t range[2];
+
+    range[0] = start * PBLOCK_SIZE;
+    range[1] = count * PBLOCK_SIZE;
+    if (regular_file) {
+	    // a hole reads as zero
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		range[0], range[1]) < 0) {
+	    return 0;
+	}
+    } else if (ioctl(fd, BLKZEROOUT, range) < 0) {
+	return 0;
+    }
+    return 1;
+}
+
+
+//
+// Discard what was allocated when the map was opened and is free
+// now.  Both lists are in base order, so one merge pass finds them.
+// Returns the number of blocks discarded, or -1 if the medium
+// refused.
+//
+int
+discard_freed_space(partition_map_header *map)
+{
+    partition_map * entry;
+    struct extent *a;
+    uint64_t start;
+    uint64_t end;
+    uint64_t run_start;
+    uint64_t run_end;
+    uint64_t fs;
+    uint64_t fe;
+    long total;
+    long i;
+
+    if (map->allocated == NULL) {
+	return 0;
+    }
+    total = 0;
+    run_start = 0;
+    run_end = 0;
+    i = 0;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) != 0) {
+	    continue;
+	}
+	fs = entry->data->dpme_pblock_start;
+	fe = fs + entry->data->dpme_pblocks;
+	    // skip extents that end before this free one
+	while (i < map->allocated_count
+		&& (uint64_t) map->allocated[i].start
+		    + map->allocated[i].length <= fs) {
+	    i++;
+	}
+	for (a = &map->allocated[i]; a < map->allocated + map->allocated_count
+		&& a->start < fe; a++) {
+	    start = (a->start > fs)? a->start: fs;
+	    end = (uint64_t) a->start + a->length;
+	    if (end > fe) {
+		end = fe;
+	    }
+	    if (start >= end) {
+		continue;
+	    }
+	    if (run_end == start) {
+		run_end = end;
+		continue;
+	    }
+	    if (run_end > run_start) {
+		if (discard_blocks(map->fd, map->regular_file, run_start,
+			run_end - run_start) == 0) {
+		    error(errno, "can't discard blocks %llu to %llu",
+			    (unsigned long long) run_start,
+			    (unsigned long long) run_end - 1);
+		    return -1;
+		}
+		total += run_end - run_start;
+	    }
+	    run_start = start;
+	    run_end = end;
+	}
+    }
+    if (run_end > run_start) {
+	if (discard_blocks(map->fd, map->regular_file, run_start,
+		run_end - run_start) == 0) {
+	    error(errno, "can't discard blocks %llu to %llu",
+		    (unsigned long long) run_start,
+		    (unsigned long long) run_end - 1);
+	    return -1;
+	}
+	total += run_end - run_start;
+    }
+    if (total > 0) {
+	printf("Discarded %ld blocks freed since the map was read.\n", total);
+    }
+    snapshot_allocated(map);
+    return total;
+}
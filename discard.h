@@ -0,0 +1,37 @@
+//
+// discard.h - give the blocks of deleted partitions back to the medium
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+struct extent {
+    uint32_t start;
+    uint32_t length;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+extern int discard_flag;
+
+
+//
+// Forward declarations
+//
+int discard_blocks(int fd, int regular_file, uint64_t start, uint64_t count);
+int discard_freed_space(partition_map_header *map);
+void snapshot_allocated(partition_map_header *map);
+int zero_blocks(int fd, int regular_file, uint64_t start, uint64_t count);
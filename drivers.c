@@ -0,0 +1,343 @@
+//
+// drivers.c - verify the driver partitions of disk images
+//
+// A driver partition holds dpme_boot_bytes of driver code starting at
+// its logical block dpme_boot_block, and dpme_checksum is the Apple
+// driver checksum of that code.  Block zero lists each driver in its
+// descriptor map.  Here the code is read back and both are checked.
+//
+// The checksum adds each byte and rotates the 16 bit sum left by one,
+// so every step depends on the one before and it can't be split into
+// independent lanes; it runs at about a byte a cycle, far quicker than
+// the code can be read.  What does pay off over a library of images is
+// working on several images at once, so the images are handed to the
+// thread pool and each image's driver reads go out in one batch.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "output.h"
+#include "check.h"
+#include "pool.h"
+#include "drivers.h"
+
+
+//
+// Defines
+//
+#define DRIVERS_FLUSH	(32*1024)
+#define MAX_DRIVERS	(sizeof(((Block0 *)0)->sbMap) / sizeof(DDMap))
+
+
+//
+// Types
+//
+struct driver_job {
+    char **names;
+    output_buffer **buffers;
+    pthread_mutex_t out_lock;
+    long failed;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int check_driver_code(output_buffer *ob, partition_map_header *map);
+int check_driver_map(output_buffer *ob, partition_map_header *map);
+int driver_code_fits(partition_map_header *map, DPME *p);
+int is_driver(partition_map *entry);
+void verify_image_drivers(long task, int worker, void *arg);
+
+
+//
+// Routines
+//
+uint16_t
+driver_checksum(const unsigned char *p, unsigned long len)
+{
+    uint16_t sum;
+
+    sum = 0;
+    while (len-- > 0) {
+	sum += *p++;
+	sum = (sum << 1) | (sum >> 15);
+    }
+    if (sum == 0) {
+	sum = 0xFFFF;
+    }
+    return sum;
+}
+
+
+int
+is_driver(partition_map *entry)
+{
+    return strstr(entry->data->dpme_type, "Driver") != NULL;
+}
+
+
+int
+driver_code_fits(partition_map_header *map, DPME *p)
+{
+    return (uint64_t) p->dpme_boot_block * PBLOCK_SIZE + p->dpme_boot_bytes
+		<= (uint64_t) p->dpme_pblocks * PBLOCK_SIZE
+	    && (uint64_t) p->dpme_pblock_start + p->dpme_pblocks
+		<= map->media_size;
+}
+
+
+//
+// Read the code of every driver partition in one batch and check its
+// size and checksum.
+//
+int
+check_driver_code(output_buffer *ob, partition_map_header *map)
+{
+    partition_map * entry;
+    partition_map ** entries;
+    struct io_request *req;
+    DPME *p;
+    char *buf;
+    size_t size;
+    uint16_t sum;
+    int issues;
+    int count;
+    int i;
+
+    issues = 0;
+    count = 0;
+    size = 0;
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	if (!is_driver(entry)) {
+	    continue;
+	}
+	p = entry->data;
+	if (p->dpme_boot_bytes == 0) {
+	    report_issue(ob, map->name, "no_driver_code", entry->disk_address,
+		    "driver partition records no driver code");
+	    issues++;
+	} else if (!driver_code_fits(map, p)) {
+	    report_issue(ob, map->name, "driver_size", entry->disk_address,
+		    "%u bytes of driver code at block %u don't fit the partition",
+		    p->dpme_boot_bytes, p->dpme_boot_block);
+	    issues++;
+	} else {
+	    count++;
+	    size += (p->dpme_boot_bytes + PBLOCK_SIZE - 1) / PBLOCK_SIZE;
+	}
+    }
+    if (count == 0) {
+	return issues;
+    }
+
+    entries = (partition_map **) malloc(count * sizeof(partition_map *));
+    req = (struct io_request *) malloc(count * sizeof(struct io_request));
+    buf = (char *) malloc(size * PBLOCK_SIZE);
+    if (entries == NULL || req == NULL || buf == NULL) {
+	error(errno, "can't allocate memory for driver buffers");
+	free(entries);
+	free(req);
+	free(buf);
+	return issues;
+    }
+    i = 0;
+    size = 0;
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	p = entry->data;
+	if (!is_driver(entry) || p->dpme_boot_bytes == 0
+		|| !driver_code_fits(map, p)) {
+	    continue;
+	}
+	entries[i] = entry;
+	req[i].block = p->dpme_pblock_start + p->dpme_boot_block;
+	req[i].count = (p->dpme_boot_bytes + PBLOCK_SIZE - 1) / PBLOCK_SIZE;
+	req[i].buf = buf + size * PBLOCK_SIZE;
+	size += req[i].count;
+	i++;
+    }
+    read_batch(map->fd, req, count);
+
+    for (i = 0; i < count; i++) {
+	p = entries[i]->data;
+	if (req[i].ok == 0) {
+	    report_issue(ob, map->name, "unreadable", entries[i]->disk_address,
+		    "can't read driver code at block %lu", req[i].block);
+	    issues++;
+	    continue;
+	}
+	sum = driver_checksum((unsigned char *) req[i].buf, p->dpme_boot_bytes);
+	if (sum != (p->dpme_checksum & 0xFFFF)) {
+	    report_issue(ob, map->name, "checksum", entries[i]->disk_address,
+		    "driver checksum is 0x%04x, the entry says 0x%04x",
+		    sum, p->dpme_checksum & 0xFFFF);
+	    issues++;
+	}
+    }
+    free(buf);
+    free(entries);
+    free(req);
+    return issues;
+}
+
+
+//
+// Every driver partition should be in block zero's descriptor map,
+// and every descriptor should start a driver partition that holds it.
+//
+int
+check_driver_map(output_buffer *ob, partition_map_header *map)
+{
+    partition_map * entry;
+    Block0 *zero;
+    DDMap *m;
+    int drivers;
+    int issues;
+    int i;
+
+    issues = 0;
+    zero = map->misc;
+    drivers = 0;
+    if (zero->sbSig == BLOCK0_SIGNATURE) {
+	drivers = zero->sbDrvrCount;
+	if (drivers > MAX_DRIVERS) {
+	    drivers = MAX_DRIVERS;
+	}
+    }
+    m = (DDMap *) zero->sbMap;
+
+    for (i = 0; i < drivers; i++) {
+	entry = find_entry_by_sector(m[i].ddBlock, map);
+	if (entry == NULL || !is_driver(entry)
+		|| entry->data->dpme_pblock_start != m[i].ddBlock) {
+	    report_issue(ob, map->name, "driver", 0,
+		    "driver %d at block %u does not start a driver partition",
+		    i + 1, m[i].ddBlock);
+	    issues++;
+	} else if (entry->data->dpme_boot_bytes != 0
+		&& (unsigned long) m[i].ddSize * PBLOCK_SIZE
+		    < entry->data->dpme_boot_bytes) {
+	    report_issue(ob, map->name, "driver_size", entry->disk_address,
+		    "driver %d is %u blocks, shorter than its %u bytes of code",
+		    i + 1, m[i].ddSize, entry->data->dpme_boot_bytes);
+	    issues++;
+	}
+    }
+
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	if (!is_driver(entry)) {
+	    continue;
+	}
+	for (i = 0; i < drivers; i++) {
+	    if (m[i].ddBlock == entry->data->dpme_pblock_start) {
+		break;
+	    }
+	}
+	if (i >= drivers) {
+	    report_issue(ob, map->name, "driver", entry->disk_address,
+		    "driver partition is not in block zero's driver map");
+	    issues++;
+	}
+    }
+    return issues;
+}
+
+
+void
+verify_image_drivers(long task, int worker, void *arg)
+{
+    struct driver_job *job = (struct driver_job *) arg;
+    output_buffer *ob = job->buffers[worker];
+    partition_map_header *map;
+    int issues;
+    int junk;
+
+    map = open_partition_map(job->names[task], &junk);
+    if (map == NULL) {
+	__sync_fetch_and_add(&job->failed, 1);
+	return;
+    }
+    issues = check_driver_map(ob, map);
+    issues += check_driver_code(ob, map);
+    if (issues == 0 && output_format == kTextFormat) {
+	out_printf(ob, "%s: drivers ok\n", map->name);
+    }
+    close_partition_map(map);
+
+    if (ob->len >= DRIVERS_FLUSH) {
+	pthread_mutex_lock(&job->out_lock);
+	flush_output(ob);
+	pthread_mutex_unlock(&job->out_lock);
+    }
+}
+
+
+//
+// Verify the drivers of each named image on up to workers threads.
+// Returns the number of problems found, or -1 if an image could not
+// be read.
+//
+long
+verify_drivers(char **names, int count, int workers)
+{
+    struct driver_job job;
+    long before;
+    int i;
+
+    if (workers <= 0) {
+	workers = default_pool_size();
+    }
+    if (workers > count) {
+	workers = count;
+    }
+    job.names = names;
+    job.failed = 0;
+    job.buffers = (output_buffer **) calloc(workers, sizeof(output_buffer *));
+    if (job.buffers == NULL) {
+	error(errno, "can't allocate memory for driver buffers");
+	return -1;
+    }
+    for (i = 0; i < workers; i++) {
+	if ((job.buffers[i] = new_output_buffer(1)) == NULL) {
+	    workers = i;
+	    break;
+	}
+    }
+    pthread_mutex_init(&job.out_lock, NULL);
+
+    before = issue_count;
+    if (workers > 0) {
+	fflush(stdout);
+	run_pool(count, workers, verify_image_drivers, &job);
+    } else {
+	job.failed = count;
+    }
+
+    for (i = 0; i < workers; i++) {
+	free_output_buffer(job.buffers[i]);
+    }
+    pthread_mutex_destroy(&job.out_lock);
+    free(job.buffers);
+    if (job.failed > 0) {
+	return -1;
+    }
+    return issue_count - before;
+}
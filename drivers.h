@@ -0,0 +1,36 @@
+//
+// drivers.h - verify the driver partitions of disk images
+//
+#ifndef drivers_h
+#define drivers_h
+
+#include <stdint.h>
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+uint16_t driver_checksum(const unsigned char *p, unsigned long len);
+long verify_drivers(char **names, int count, int workers);
+
+#endif
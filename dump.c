@@ -40,6 +40,8 @@
 #include "io.h"
 #include "errors.h"
 #include "partition_map.h"
+#include "output.h"
+#include "fsprobe.h"
 #include "dump.h"
 
 
@@ -61,6 +63,24 @@
 const char * kStringEmpty	= "";
 const char * kStringNot		= " not";
 
+// Apple_UNIX_SVR2 must stay first, swap is recognised by name
+const struct system_name {
+    const char *type;
+    const char *system;
+} systems[] = {
+    {"Apple_UNIX_SVR2",		"Linux native"},
+    {"Apple_Bootstrap",		"NewWorld bootblock"},
+    {"Apple_Scratch",		"Linux swap"},	//not just linux, but who cares
+    {"Apple_HFS",		"HFS"},
+    {"Apple_MFS",		"MFS"},
+    {"Apple_Driver",		"Driver"},
+    {"Apple_Driver43",		"Driver 4.3"},
+    {"Apple_partition_map",	"Partition map"},
+    {"Apple_PRODOS",		"ProDOS"},
+    {"Apple_Free",		"Free space"},
+    {0, 0}
+};
+
 
 //
 // Global Variables
@@ -70,8 +90,13 @@ const char * kStringNot		= " not";
 //
 // Forward declarations
 //
-void dump_block_zero(partition_map_header *map);
-void dump_partition_entry(partition_map *entry, int digits, char *dev);
+void dump_block_zero(partition_map_header *map, output_buffer *ob);
+void dump_map_records(partition_map_header *map, output_buffer *ob);
+void dump_partition_entry(output_buffer *ob, partition_map *entry, int digits, char *dev);
+void dump_volumes(partition_map_header *map, output_buffer *ob, char *dev);
+void format_flags(DPME *p, char *s);
+const char* partition_system_name(partition_map *entry);
+struct fs_probe* volume_info(partition_map *entry);
 
 
 //
@@ -95,7 +120,7 @@ dump(char *name)
 
 
 void
-dump_block_zero(partition_map_header *map)
+dump_block_zero(partition_map_header *map, output_buffer *ob)
 {
     Block0 *p;
     DDMap *m;
@@ -105,26 +130,30 @@ dump_block_zero(partition_map_header *map)
     if (p->sbSig != BLOCK0_SIGNATURE) {
 	return;
     }
-    printf("\nBlock size=%u, Number of Blocks=%u\n",
-	    p->sbBlkSize, p->sbBlkCount);
-    printf("DeviceType=0x%x, DeviceId=0x%x\n",
-	    p->sbDevType, p->sbDevId);
+    out_printf(ob, "\nBlock size=%u, Number of Blocks=%u\n"
+	    "DeviceType=0x%x, DeviceId=0x%x\n",
+	    p->sbBlkSize, p->sbBlkCount, p->sbDevType, p->sbDevId);
     if (p->sbDrvrCount > 0) {
-	printf("Drivers-\n");
+	out_puts(ob, "Drivers-\n");
 	m = (DDMap *) p->sbMap;
 	for (i = 0; i < p->sbDrvrCount; i++) {
-	    printf("%u: @ %u for %u, type=0x%x\n", i+1, m[i].ddBlock,
+	    out_printf(ob, "%u: @ %u for %u, type=0x%x\n", i+1, m[i].ddBlock,
 		    m[i].ddSize, m[i].ddType);
 	}
     }
-    printf("\n");
+    out_putc(ob, '\n');
 }
 
 
+//
+// The whole listing of a map is formatted into the standard output
+// buffer and goes out with a single flush.
+//
 void
 dump_partition_map(partition_map_header *map, int disk_order)
 {
     partition_map * entry;
+    output_buffer *ob;
     int j;
     size_t len;
     char *buf;
@@ -133,21 +162,32 @@ dump_partition_map(partition_map_header *map, int disk_order)
 	bad_input("No partition map exists");
 	return;
     }
-    printf("%s\n", map->name);
+    ob = standard_output();
+    if (probe_flag || volume_flag) {
+	probe_partitions(map);
+    }
+    if (output_format != kTextFormat) {
+	dump_map_records(map, ob);
+	flush_output(ob);
+	return;
+    }
 
     j = number_of_digits(map->media_size);
     if (j < 7) {
 	j = 7;
     }
-	// convert size_t to int for "*" format specifier
-	int mapNameWidth = strlen(map->name)+1;
-    printf("%*s                    type name               "
-	    "%*s   %-*s ( size )  system\n", mapNameWidth, "#", j, "length", j, "base");
+    len = strlen(map->name);
+    out_printf(ob, "%s\n%*s                    type name               "
+	    "%*s   %-*s ( size )  system\n",
+	    map->name, (int) len + 1, "#", j, "length", j, "base");
 
     /* Grok devfs names. (courtesy Colin Walters)*/
 
-    len = strlen(map->name);
     buf = strdup(map->name);
+    if (buf == NULL) {
+	error(errno, "can't allocate memory for device name");
+	return;
+    }
     if (len >= 4 && !strcmp(buf+len-4, "disc")) {
 	strcpy(buf+len-4, "part");
     }
@@ -156,68 +196,31 @@ dump_partition_map(partition_map_header *map, int disk_order)
 	for (entry = map->disk_order; entry != NULL;
 		entry = entry->next_on_disk) {
 
-	    dump_partition_entry(entry, j, buf);
+	    dump_partition_entry(ob, entry, j, buf);
 	}
     } else {
 	for (entry = map->base_order; entry != NULL;
 		entry = entry->next_by_base) {
 
-	    dump_partition_entry(entry, j, buf);
+	    dump_partition_entry(ob, entry, j, buf);
 	}
     }
-    dump_block_zero(map);
+    dump_volumes(map, ob, buf);
+    free(buf);
+    dump_block_zero(map, ob);
+    flush_output(ob);
 }
 
 
 void
-dump_partition_entry(partition_map *entry, int digits, char *dev)
+dump_partition_entry(output_buffer *ob, partition_map *entry, int digits, char *dev)
 {
-    int j;
     DPME *p;
-    char *s;
-    int aflag = 0;
-    int pflag = 1;
-    uint32_t size;
+    int j;
     double bytes;
 
-
     p = entry->data;
-    if (aflag) {
-	s = "????";
-	for (j = 0; plist[j].abbr != 0; j++) {
-	    if (strcmp(p->dpme_type, plist[j].full) == 0) {
-		s = plist[j].abbr;
-		break;
-	    }
-	}
-	printf("%s%-4ld  %.4s %-18.32s ", dev, entry->disk_address, s, p->dpme_name);
-    } else {
-	printf("%s%-4ld %20.32s %-18.32s ", dev, 
-		entry->disk_address, p->dpme_type, p->dpme_name);
-    }
-
-    if (pflag) {
-	printf("%*u ", digits, p->dpme_pblocks);
-	size = p->dpme_pblocks;
-    } else if (p->dpme_lblocks + p->dpme_lblock_start != p->dpme_pblocks) {
-	printf("%*u+", digits, p->dpme_lblocks);
-	size = p->dpme_lblocks;
-    } else if (p->dpme_lblock_start != 0) {
-	printf("%*u ", digits, p->dpme_lblocks);
-	size = p->dpme_lblocks;
-    } else {
-	printf("%*u ", digits, p->dpme_pblocks);
-	size = p->dpme_pblocks;
-    }
-    if (pflag || p->dpme_lblock_start == 0) {
-	printf("@ %-*u", digits, p->dpme_pblock_start);
-    } else {
-	printf("@~%-*u", digits, p->dpme_pblock_start + p->dpme_lblock_start);
-    }
-    
-    j = 's';
-
-    bytes = size / ONE_KILOBYTE_IN_BLOCKS;
+    bytes = p->dpme_pblocks / ONE_KILOBYTE_IN_BLOCKS;
     j = 'k';
     if (bytes >= 1024.0) {
 	bytes = bytes / 1024.0;
@@ -228,45 +231,41 @@ dump_partition_entry(partition_map *entry, int digits, char *dev)
 	    j = 'G';
 	}
     }
-    printf(" (%#5.1f%c)  ", bytes, j);
-
-    if (!strcmp(p->dpme_type, "Apple_UNIX_SVR2"))
-    {
-         if (!strcmp(p->dpme_name, "Swap") || !strcmp(p->dpme_name, "swap"))
-            printf("Linux swap");
-         else
-            printf("Linux native");
+    out_printf(ob, "%s%-4ld %20.32s %-18.32s %*u @ %-*u (%#5.1f%c)  %s\n",
+	    dev, entry->disk_address, p->dpme_type, p->dpme_name,
+	    digits, p->dpme_pblocks, digits, p->dpme_pblock_start,
+	    bytes, j, partition_system_name(entry));
+}
+
+
+//
+// Say what lives in a partition: what was found there if it has been
+// probed, otherwise a guess from its type and name.
+//
+const char *
+partition_system_name(partition_map *entry)
+{
+    DPME *p;
+    int i;
+
+    p = entry->data;
+    if (entry->probe != NULL && entry->probe->kind != kFSUnknown
+	    && entry->probe->base == p->dpme_pblock_start) {
+	return fs_name(entry->probe->kind);
     }
-    else
-    if (!strcmp(p->dpme_type, "Apple_Bootstrap"))
-         printf("NewWorld bootblock");
-    else
-    if (!strcmp(p->dpme_type, "Apple_Scratch"))
-         printf("Linux swap");  //not just linux, but who cares
-    else
-    if (!strcmp(p->dpme_type, "Apple_HFS"))
-         printf("HFS");
-    else
-    if (!strcmp(p->dpme_type, "Apple_MFS"))
-        printf("MFS");
-    else
-    if (!strcmp(p->dpme_type, "Apple_Driver"))
-        printf("Driver");
-    else
-    if (!strcmp(p->dpme_type, "Apple_Driver43"))
-        printf("Driver 4.3");
-    else
-    if (!strcmp(p->dpme_type, "Apple_partition_map"))
-        printf("Partition map");
-    else
-    if (!strcmp(p->dpme_type, "Apple_PRODOS"))
-        printf("ProDOS");
-    else
-    if (!strcmp(p->dpme_type, "Apple_Free"))
-        printf("Free space");
-    else
-        printf("Unknown");
-    printf("\n");
+    for (i = 0; systems[i].type != 0; i++) {
+	if (strncmp(p->dpme_type, systems[i].type, DPISTRLEN) == 0) {
+	    break;
+	}
+    }
+    if (systems[i].type == 0) {
+	return "Unknown";
+    }
+    if (i == 0 && (!strncmp(p->dpme_name, "Swap", DPISTRLEN)
+	    || !strncmp(p->dpme_name, "swap", DPISTRLEN))) {
+	return "Linux swap";
+    }
+    return systems[i].system;
 }
 
 
@@ -330,11 +329,20 @@ show_data_structures(partition_map_header *map)
     DPME *p;
     BZB *bp;
     char *s;
+    char flags[11];
 
     if (map == NULL) {
 	printf("No partition map exists\n");
 	return;
     }
+    if (output_format != kTextFormat) {
+	if (probe_flag || volume_flag) {
+	    probe_partitions(map);
+	}
+	dump_map_records(map, standard_output());
+	flush_output(standard_output());
+	return;
+    }
     printf("Header:\n");
     printf("fd=%d (%s)\n", map->fd, (map->regular_file)?"file":"device");
     printf("map %d blocks out of %d,  media %u blocks\n",
@@ -384,17 +392,8 @@ uint32_t     dpme_reserved_3[62]     ;
 	printf("%2ld: %20.32s ",
 		entry->disk_address, p->dpme_type);
 	printf("%7u @ %-7u ", p->dpme_pblocks, p->dpme_pblock_start);
-	printf("%c%c%c%c%c%c%c%c%c%c ",
-		(dpme_valid_get(p))?'V':'v',
-		(dpme_allocated_get(p))?'A':'a',
-		(dpme_in_use_get(p))?'I':'i',
-		(dpme_bootable_get(p))?'B':'b',
-		(dpme_readable_get(p))?'R':'r',
-		(dpme_writable_get(p))?'W':'w',
-		(dpme_os_pic_code_get(p))?'P':'p',
-		(dpme_os_specific_1_get(p))?'1':'.',
-		(dpme_os_specific_2_get(p))?'2':'.',
-		(dpme_automount_get(p))?'M':'m');
+	format_flags(p, flags);
+	printf("%s ", flags);
 	if (p->dpme_lblock_start != 0 || p->dpme_pblocks != p->dpme_lblocks) {
 	    printf("(%u @ %u)", p->dpme_lblocks, p->dpme_lblock_start);
 	}
@@ -465,3 +464,189 @@ xx: cccc RU *dd s...
 }
 
 
+//
+// Flag letters as shown by show_data_structures, upper case when set.
+//
+void
+format_flags(DPME *p, char *s)
+{
+    s[0] = (dpme_valid_get(p))?'V':'v';
+    s[1] = (dpme_allocated_get(p))?'A':'a';
+    s[2] = (dpme_in_use_get(p))?'I':'i';
+    s[3] = (dpme_bootable_get(p))?'B':'b';
+    s[4] = (dpme_readable_get(p))?'R':'r';
+    s[5] = (dpme_writable_get(p))?'W':'w';
+    s[6] = (dpme_os_pic_code_get(p))?'P':'p';
+    s[7] = (dpme_os_specific_1_get(p))?'1':'.';
+    s[8] = (dpme_os_specific_2_get(p))?'2':'.';
+    s[9] = (dpme_automount_get(p))?'M':'m';
+    s[10] = 0;
+}
+
+
+//
+// Machine readable form of everything show_data_structures prints:
+// a map record, a block0 record, a driver record per DDMap and an
+// entry record per map entry (in disk order) including boot and BZB
+// fields.  See hfdisk(8) for the TSV column order.
+//
+void
+dump_map_records(partition_map_header *map, output_buffer *ob)
+{
+    partition_map * entry;
+    Block0 *zp;
+    DDMap *m;
+    DPME *p;
+    BZB *bp;
+    struct fs_probe *v;
+    char flags[11];
+    char *bzb_type;
+    int i;
+
+    out_begin_record(ob, "map");
+    out_text_field(ob, "device", map->name, strlen(map->name));
+    out_number_field(ob, "media_blocks", map->media_size);
+    out_number_field(ob, "entries", map->blocks_in_map);
+    out_number_field(ob, "map_blocks",
+	    (map->maximum_in_map < 0)? 0: map->maximum_in_map);
+    out_number_field(ob, "regular_file", map->regular_file);
+    out_number_field(ob, "writeable", map->writeable);
+    out_number_field(ob, "changed", map->changed);
+    out_end_record(ob);
+
+    zp = map->misc;
+    if (zp != NULL) {
+	out_begin_record(ob, "block0");
+	out_text_field(ob, "device", map->name, strlen(map->name));
+	out_number_field(ob, "signature", zp->sbSig);
+	out_number_field(ob, "block_size", zp->sbBlkSize);
+	out_number_field(ob, "block_count", zp->sbBlkCount);
+	out_number_field(ob, "device_type", zp->sbDevType);
+	out_number_field(ob, "device_id", zp->sbDevId);
+	out_number_field(ob, "data", zp->sbData);
+	out_number_field(ob, "driver_count", zp->sbDrvrCount);
+	out_end_record(ob);
+
+	m = (DDMap *) zp->sbMap;
+	for (i = 0; zp->sbSig == BLOCK0_SIGNATURE && i < zp->sbDrvrCount
+		&& i < sizeof(zp->sbMap) / sizeof(DDMap); i++) {
+	    out_begin_record(ob, "driver");
+	    out_text_field(ob, "device", map->name, strlen(map->name));
+	    out_number_field(ob, "index", i + 1);
+	    out_number_field(ob, "block", m[i].ddBlock);
+	    out_number_field(ob, "size", m[i].ddSize);
+	    out_number_field(ob, "type", m[i].ddType);
+	    out_end_record(ob);
+	}
+    }
+
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	p = entry->data;
+	format_flags(p, flags);
+	out_begin_record(ob, "entry");
+	out_text_field(ob, "device", map->name, strlen(map->name));
+	out_number_field(ob, "index", entry->disk_address);
+	out_text_field(ob, "type", p->dpme_type, DPISTRLEN);
+	out_text_field(ob, "name", p->dpme_name, DPISTRLEN);
+	out_number_field(ob, "base", p->dpme_pblock_start);
+	out_number_field(ob, "length", p->dpme_pblocks);
+	out_number_field(ob, "logical_base", p->dpme_lblock_start);
+	out_number_field(ob, "logical_length", p->dpme_lblocks);
+	out_text_field(ob, "flags", flags, sizeof(flags));
+	out_number_field(ob, "boot_block", p->dpme_boot_block);
+	out_number_field(ob, "boot_bytes", p->dpme_boot_bytes);
+	out_number_field(ob, "load_address", p->dpme_load_addr);
+	out_number_field(ob, "load_address_2", p->dpme_load_addr_2);
+	out_number_field(ob, "goto_address", p->dpme_goto_addr);
+	out_number_field(ob, "goto_address_2", p->dpme_goto_addr_2);
+	out_number_field(ob, "checksum", p->dpme_checksum);
+	out_text_field(ob, "processor", p->dpme_process_id,
+		sizeof(p->dpme_process_id));
+	out_text_field(ob, "system", partition_system_name(entry), DPISTRLEN);
+
+	bp = (BZB *) (p->dpme_bzb);
+	if (bp->bzb_magic == BZBMAGIC) {
+	    switch (bp->bzb_type) {
+	    case FSTEFS:
+		bzb_type = "esch";
+		break;
+	    case FSTSFS:
+		bzb_type = "swap";
+		break;
+	    case FST:
+	    default:
+		bzb_type = "fsys";
+		break;
+	    }
+	} else {
+	    bzb_type = "";
+	}
+	out_text_field(ob, "bzb_type", bzb_type, 4);
+	out_number_field(ob, "bzb_root",
+		(*bzb_type)? bzb_root_get(bp): 0);
+	out_number_field(ob, "bzb_usr",
+		(*bzb_type)? bzb_usr_get(bp): 0);
+	out_number_field(ob, "bzb_slice",
+		(*bzb_type)? bzb_slice_get(bp): 0);
+	out_text_field(ob, "bzb_mount_point",
+		(*bzb_type)? (char *) bp->bzb_mount_point: "",
+		sizeof(bp->bzb_mount_point));
+	out_end_record(ob);
+
+	v = volume_info(entry);
+	if (v != NULL) {
+	    out_begin_record(ob, "volume");
+	    out_text_field(ob, "device", map->name, strlen(map->name));
+	    out_number_field(ob, "index", entry->disk_address);
+	    out_text_field(ob, "format", fs_name(v->kind), DPISTRLEN);
+	    out_text_field(ob, "name", v->name, sizeof(v->name));
+	    out_number_field(ob, "block_size", v->block_size);
+	    out_number_field(ob, "total_blocks", v->total_blocks);
+	    out_number_field(ob, "free_blocks", v->free_blocks);
+	    out_end_record(ob);
+	}
+    }
+}
+
+
+//
+// The HFS or HFS+ volume in entry, if --volumes found one there.
+//
+struct fs_probe *
+volume_info(partition_map *entry)
+{
+    struct fs_probe *v = entry->probe;
+
+    if (!volume_flag || v == NULL || v->block_size == 0
+	    || v->base != entry->data->dpme_pblock_start) {
+	return NULL;
+    }
+    return v;
+}
+
+
+void
+dump_volumes(partition_map_header *map, output_buffer *ob, char *dev)
+{
+    partition_map * entry;
+    struct fs_probe *v;
+    int first;
+
+    first = 1;
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	v = volume_info(entry);
+	if (v == NULL) {
+	    continue;
+	}
+	if (first) {
+	    out_puts(ob, "\nVolumes-\n");
+	    first = 0;
+	}
+	out_printf(ob, "%s%-4ld %-11s \"%s\" %u blocks of %u bytes, "
+		"%.1fM of %.1fM free\n",
+		dev, entry->disk_address, fs_name(v->kind), v->name,
+		v->total_blocks, v->block_size,
+		(double) v->free_blocks * v->block_size / (1024 * 1024),
+		(double) v->total_blocks * v->block_size / (1024 * 1024));
+    }
+}
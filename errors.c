@@ -79,8 +79,26 @@ do_help()
 {
     printf("\t%s [-h|--help]\n", program_name);
     printf("\t%s [-v|--version]\n", program_name);
-    printf("\t%s [-l|--list [name ...]]\n", program_name);
-    printf("\t%s [-r|--readonly] name ...\n", program_name);
+    printf("\t%s [-l|--list [name ...]] [--format=text|json|tsv]\n\t\t[--probe] [--volumes] [--cache=file [--verify-cache]]\n", program_name);
+    printf("\t%s [-r|--readonly] [--discard] [--wipe-signatures]\n\t\t[--verify] [--align=size] name ...\n", program_name);
+    printf("\t%s --scan [--jobs=n] [--format=json|tsv] [--cache=file] directory ...\n", program_name);
+    printf("\t%s --check [--format=json|tsv] name ...\n", program_name);
+    printf("\t%s --verify-drivers [--jobs=n] [--format=json|tsv] name ...\n", program_name);
+    printf("\t%s --hash [--jobs=n] [--format=json|tsv] name ...\n", program_name);
+    printf("\t%s [-r|--readonly] [--verify] --recover name ...\n", program_name);
+    printf("\t%s --sparsify[=free] image ...\n", program_name);
+    printf("\t%s [--move=n:base] [--resize=n:length] [--checkpoint=file]\n\t\t[--verify] [--discard] name\n", program_name);
+    printf("\t%s --grow-map=blocks [--checkpoint=file] [--verify] name\n", program_name);
+    printf("\t%s --fill[=partition] [--verify] name ...\n", program_name);
+    printf("\t%s --shrink [--verify] image ...\n", program_name);
+    printf("\t%s --compact[=shrink] [--verify] name ...\n", program_name);
+    printf("\t%s [-r|--readonly] --layout=file [--align=size] [--verify] name ...\n", program_name);
+    printf("\t%s --extract=partition name file\n", program_name);
+    printf("\t%s --inject=partition name file\n", program_name);
+    printf("\t%s --flash [--discard] image device\n", program_name);
+    printf("\t%s --capture-template=file name\n", program_name);
+    printf("\t%s --stamp-template=file [--verify] name ...\n", program_name);
+    printf("\t%s --clone-layout=name [--verify] name ...\n", program_name);
     printf("\t%s name ...\n", program_name);
 }
 
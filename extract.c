@@ -0,0 +1,398 @@
+//
+// extract.c - copy a partition's contents to a file and back
+//
+// The partition is named by its index or by its name in the map.  The
+// copy is first offered to the file system as a clone (FICLONERANGE),
+// which shares the extents and copies nothing; that needs both files on
+// one file system and the partition aligned to its blocks.  Otherwise
+// the data extents of the source are copied with copy_file_range(), and
+// by hand through a buffer where that is not supported, while its holes
+// and any all-zero chunks are left as holes in the destination.
+//
+
+#define _GNU_SOURCE	// for copy_file_range, fallocate and SEEK_DATA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "sparse.h"
+#include "extract.h"
+
+
+//
+// Defines
+//
+#define EXTRACT_CHUNK	(8*1024*1024)
+
+
+//
+// Types
+//
+struct copy_state {
+    int in;
+    int out;
+    off_t in_base;		// where the copy starts in each
+    off_t out_base;
+    int out_regular;
+    int out_zero;		// the destination already reads as zero
+    int by_hand;		// copy_file_range() is not supported
+    char *buf;
+    int cloned;
+    off_t copied;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int clone_extent(struct copy_state *s, off_t len);
+int copy_data(struct copy_state *s, off_t pos, off_t end);
+int copy_extent(struct copy_state *s, off_t len);
+int zero_range(struct copy_state *s, off_t pos, off_t end);
+
+
+//
+// Routines
+//
+
+//
+// Returns 1 if the file system shared the whole extent.
+//
+int
+clone_extent(struct copy_state *s, off_t len)
+{
+    struct file_clone_range range;
+
+    range.src_fd = s->in;
+    range.src_offset = s->in_base;
+    range.src_length = len;
+    range.dest_offset = s->out_base;
+    if (ioctl(s->out, FICLONERANGE, &range) < 0) {
+	return 0;
+    }
+    s->cloned = 1;
+    s->copied = len;
+    return 1;
+}
+
+
+int
+zero_range(struct copy_state *s, off_t pos, off_t end)
+{
+    size_t len;
+    ssize_t t;
+
+    if (s->out_zero || pos >= end) {
+	return 1;
+    }
+    if (s->out_regular && fallocate(s->out,
+	    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    s->out_base + pos, end - pos) == 0) {
+	return 1;
+    }
+    memset(s->buf, 0, EXTRACT_CHUNK);
+    while (pos < end) {
+	len = (end - pos < EXTRACT_CHUNK)? end - pos: EXTRACT_CHUNK;
+	t = pwrite(s->out, s->buf, len, s->out_base + pos);
+	if (t < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (t <= 0) {
+	    error((t < 0)? errno: 0, "can't write at byte %lld",
+		    (long long) (s->out_base + pos));
+	    return 0;
+	}
+	pos += t;
+    }
+    return 1;
+}
+
+
+int
+copy_data(struct copy_state *s, off_t pos, off_t end)
+{
+    loff_t in;
+    loff_t out;
+    size_t len;
+    ssize_t t;
+    ssize_t w;
+
+    while (!s->by_hand && pos < end) {
+	in = s->in_base + pos;
+	out = s->out_base + pos;
+	t = copy_file_range(s->in, &in, s->out, &out, end - pos, 0);
+	if (t < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (t <= 0) {
+	    s->by_hand = 1;
+	    break;
+	}
+	pos += t;
+	s->copied += t;
+    }
+
+    while (pos < end) {
+	len = (end - pos < EXTRACT_CHUNK)? end - pos: EXTRACT_CHUNK;
+	t = pread(s->in, s->buf, len, s->in_base + pos);
+	if (t < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (t <= 0) {
+	    error((t < 0)? errno: 0, "can't read at byte %lld",
+		    (long long) (s->in_base + pos));
+	    return 0;
+	}
+	if (t % 64 == 0 && is_zero_block(s->buf, t)) {
+	    if (zero_range(s, pos, pos + t) == 0) {
+		return 0;
+	    }
+	    pos += t;
+	    continue;
+	}
+	for (len = 0; len < (size_t) t; len += w) {
+	    w = pwrite(s->out, s->buf + len, t - len, s->out_base + pos + len);
+	    if (w < 0 && errno == EINTR) {
+		w = 0;
+		continue;
+	    }
+	    if (w <= 0) {
+		error((w < 0)? errno: 0, "can't write at byte %lld",
+			(long long) (s->out_base + pos + len));
+		return 0;
+	    }
+	}
+	pos += t;
+	s->copied += t;
+    }
+    return 1;
+}
+
+
+//
+// Copy len bytes, data extent by data extent where the source knows
+// where its holes are.
+//
+int
+copy_extent(struct copy_state *s, off_t len)
+{
+    off_t pos;
+    off_t data;
+    off_t hole;
+
+    if (clone_extent(s, len)) {
+	return 1;
+    }
+    pos = 0;
+    while (pos < len) {
+	data = lseek(s->in, s->in_base + pos, SEEK_DATA);
+	if (data < 0) {
+	    // ENXIO is a hole to the end; otherwise holes are unknown
+	    data = (errno == ENXIO)? s->in_base + len: s->in_base + pos;
+	    hole = s->in_base + len;
+	} else {
+	    hole = lseek(s->in, data, SEEK_HOLE);
+	    if (hole < 0) {
+		hole = s->in_base + len;
+	    }
+	}
+	data -= s->in_base;
+	hole -= s->in_base;
+	if (data > len) {
+	    data = len;
+	}
+	if (hole > len) {
+	    hole = len;
+	}
+	if (zero_range(s, pos, data) == 0 || copy_data(s, data, hole) == 0) {
+	    return 0;
+	}
+	pos = hole;
+    }
+    return 1;
+}
+
+
+//
+// Copy the contents of partition which on name to file, which is
+// created or truncated.  Returns 1 on success.
+//
+int
+extract_partition(char *name, char *which, char *file)
+{
+    partition_map_header *map;
+    partition_map * entry;
+    struct copy_state s;
+    struct stat info;
+    uint64_t end;
+    off_t len;
+    int junk;
+    int result;
+
+    map = open_partition_map(name, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    entry = find_partition(map, which);
+    if (entry == NULL) {
+	close_partition_map(map);
+	return 0;
+    }
+    end = (uint64_t) entry->data->dpme_pblock_start + entry->data->dpme_pblocks;
+    if (end > map->media_size) {
+	error(-1, "partition %ld runs past the end of '%s'",
+		entry->disk_address, name);
+	close_partition_map(map);
+	return 0;
+    }
+    len = (off_t) entry->data->dpme_pblocks * PBLOCK_SIZE;
+
+    memset(&s, 0, sizeof(s));
+    s.in = map->fd;
+    s.in_base = (off_t) entry->data->dpme_pblock_start * PBLOCK_SIZE;
+    s.out = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (s.out < 0) {
+	error(errno, "can't create file '%s'", file);
+	close_partition_map(map);
+	return 0;
+    }
+    if (fstat(s.out, &info) == 0 && S_ISREG(info.st_mode)) {
+	s.out_regular = 1;
+	s.out_zero = (ftruncate(s.out, len) == 0);
+    }
+    if (posix_memalign((void **)&s.buf, 4096, EXTRACT_CHUNK) != 0) {
+	error(errno, "can't allocate memory for disk buffers");
+	close(s.out);
+	close_partition_map(map);
+	return 0;
+    }
+
+    result = copy_extent(&s, len);
+    if (close(s.out) < 0 && result) {
+	error(errno, "can't write file '%s'", file);
+	result = 0;
+    }
+    if (result) {
+	printf("Extracted partition %ld (%lld bytes) to %s, %s\n",
+		entry->disk_address, (long long) len, file,
+		(s.cloned)? "cloned": (s.copied < len)? "sparse": "copied");
+    }
+    free(s.buf);
+    close_partition_map(map);
+    return result;
+}
+
+
+//
+// Copy file into the start of partition which on name.  The file may
+// be shorter than the partition; the rest of it is left as it is.
+// Returns 1 on success.
+//
+int
+inject_partition(char *name, char *which, char *file)
+{
+    partition_map_header *map;
+    partition_map * entry;
+    struct copy_state s;
+    struct stat info;
+    uint64_t end;
+    off_t len;
+    int junk;
+    int result;
+
+    if (rflag) {
+	error(-1, "can't inject into '%s' in read-only mode", name);
+	return 0;
+    }
+    map = open_partition_map(name, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    if (!map->writeable) {
+	error(-1, "can't write to '%s'", name);
+	close_partition_map(map);
+	return 0;
+    }
+    entry = find_partition(map, which);
+    if (entry == NULL) {
+	close_partition_map(map);
+	return 0;
+    }
+    if (strncmp(entry->data->dpme_type, kMapType, DPISTRLEN) == 0) {
+	error(-1, "can't inject into the partition map");
+	close_partition_map(map);
+	return 0;
+    }
+    end = (uint64_t) entry->data->dpme_pblock_start + entry->data->dpme_pblocks;
+    if (end > map->media_size) {
+	error(-1, "partition %ld runs past the end of '%s'",
+		entry->disk_address, name);
+	close_partition_map(map);
+	return 0;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.in = open(file, O_RDONLY);
+    if (s.in < 0) {
+	error(errno, "can't open file '%s'", file);
+	close_partition_map(map);
+	return 0;
+    }
+    if (fstat(s.in, &info) == 0 && S_ISREG(info.st_mode)) {
+	len = info.st_size;
+    } else {
+	len = lseek(s.in, 0, SEEK_END);
+    }
+    if (len < 0 || len > (off_t) entry->data->dpme_pblocks * PBLOCK_SIZE) {
+	error(-1, "'%s' does not fit in partition %ld (%u blocks)", file,
+		entry->disk_address, entry->data->dpme_pblocks);
+	close(s.in);
+	close_partition_map(map);
+	return 0;
+    }
+    s.out = map->fd;
+    s.out_base = (off_t) entry->data->dpme_pblock_start * PBLOCK_SIZE;
+    s.out_regular = map->regular_file;
+    if (posix_memalign((void **)&s.buf, 4096, EXTRACT_CHUNK) != 0) {
+	error(errno, "can't allocate memory for disk buffers");
+	close(s.in);
+	close_partition_map(map);
+	return 0;
+    }
+
+    result = copy_extent(&s, len);
+    if (result && fsync(s.out) < 0) {
+	error(errno, "can't sync '%s'", name);
+	result = 0;
+    }
+    if (result) {
+	printf("Injected %s (%lld bytes) into partition %ld, %s\n", file,
+		(long long) len, entry->disk_address,
+		(s.cloned)? "cloned": (s.copied < len)? "sparse": "copied");
+    }
+    free(s.buf);
+    close(s.in);
+    close_partition_map(map);
+    return result;
+}
@@ -0,0 +1,30 @@
+//
+// extract.h - copy a partition's contents to a file and back
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int extract_partition(char *name, char *which, char *file);
+int inject_partition(char *name, char *which, char *file);
@@ -0,0 +1,457 @@
+//
+// flash.c - write an image to a device, skipping what isn't used
+//
+// Only block zero and the extents of the image's map that are not
+// free are read, and of those only the parts that aren't all zero are
+// written; the all-zero runs are cleared on the device with
+// BLKZEROOUT (or a punched hole in an image file) rather than sent.
+// A reader thread fills one large aligned buffer while the main thread
+// writes the other, so the read of the image and the write to the
+// device overlap.  With --discard every range outside those extents
+// is discarded on the device, merged into as few calls as possible.
+//
+// The free ranges keep whatever the device held before, or whatever a
+// discard leaves there, which need not be zeros.
+//
+// A device smaller than the image, but big enough for its partitions,
+// gets the map cut down to its size, written over the copied one at
+// the end.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "discard.h"
+#include "sparse.h"
+#include "flash.h"
+
+
+//
+// Defines
+//
+#define FLASH_CHUNK	16384		/* blocks per buffer (8MB) */
+#define FLASH_BUFFERS	2
+#define FLASH_GRAIN	128		/* blocks tested for zero at once */
+
+
+//
+// Types
+//
+struct flash_buffer {
+    uint32_t block;
+    uint32_t count;		// 0 after the last extent
+    int full;
+    char *buf;
+};
+
+struct flash_state {
+    int in;
+    int out;
+    int out_regular;
+    struct extent *list;
+    int count;
+    struct flash_buffer buffers[FLASH_BUFFERS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int failed;
+    uint64_t next;		// first block not yet written or skipped
+    uint64_t skip_start;	// pending run to discard
+    uint64_t skip_end;
+    uint64_t written;
+    uint64_t zeroed;
+    uint64_t skipped;
+    uint64_t discarded;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int collect_used(partition_map_header *map, struct extent **list);
+int flash_buffer(struct flash_state *s, struct flash_buffer *b);
+void* flash_reader(void *arg);
+void flush_skip(struct flash_state *s);
+int skip_blocks(struct flash_state *s, uint64_t start, uint64_t end);
+int write_run(struct flash_state *s, struct flash_buffer *b, uint32_t first,
+	uint32_t last, int zero);
+
+
+//
+// Routines
+//
+
+//
+// Block zero and the extents that are not free, in base order,
+// clipped to the medium.  Returns the count, or -1.
+//
+int
+collect_used(partition_map_header *map, struct extent **list)
+{
+    partition_map * entry;
+    uint64_t end;
+    int count;
+
+    count = 1;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	count++;
+    }
+    *list = (struct extent *) malloc(count * sizeof(struct extent));
+    if (*list == NULL) {
+	error(errno, "can't allocate memory for extent list");
+	return -1;
+    }
+    (*list)[0].start = 0;
+    (*list)[0].length = 1;
+    count = 1;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) == 0
+		|| entry->data->dpme_pblock_start >= map->media_size
+		|| entry->data->dpme_pblocks == 0) {
+	    continue;
+	}
+	end = (uint64_t) entry->data->dpme_pblock_start
+		+ entry->data->dpme_pblocks;
+	if (end > map->media_size) {
+	    end = map->media_size;
+	}
+	(*list)[count].start = entry->data->dpme_pblock_start;
+	(*list)[count].length = end - entry->data->dpme_pblock_start;
+	count++;
+    }
+    return count;
+}
+
+
+void*
+flash_reader(void *arg)
+{
+    struct flash_state *s = (struct flash_state *) arg;
+    struct flash_buffer *b;
+    uint64_t block;
+    uint64_t end;
+    uint32_t n;
+    int slot;
+    int ok;
+    int i;
+
+    slot = 0;
+    for (i = 0; i <= s->count; i++) {
+	if (i < s->count) {
+	    block = s->list[i].start;
+	    end = block + s->list[i].length;
+	} else {
+	    // one empty buffer marks the end
+	    block = 0;
+	    end = 1;
+	}
+	for (; block < end; block += n) {
+	    n = (end - block < FLASH_CHUNK)? end - block: FLASH_CHUNK;
+	    b = &s->buffers[slot];
+	    pthread_mutex_lock(&s->lock);
+	    while (b->full && !s->failed) {
+		pthread_cond_wait(&s->changed, &s->lock);
+	    }
+	    ok = !s->failed;
+	    pthread_mutex_unlock(&s->lock);
+	    if (!ok) {
+		return NULL;
+	    }
+	    if (i < s->count) {
+		ok = read_blocks(s->in, block, b->buf, n, 0);
+	    } else {
+		n = 0;
+	    }
+	    pthread_mutex_lock(&s->lock);
+	    if (ok) {
+		b->block = block;
+		b->count = n;
+		b->full = 1;
+	    } else {
+		s->failed = 1;
+	    }
+	    pthread_cond_broadcast(&s->changed);
+	    pthread_mutex_unlock(&s->lock);
+	    if (!ok || n == 0) {
+		return NULL;
+	    }
+	    slot = (slot + 1) % FLASH_BUFFERS;
+	}
+    }
+    return NULL;
+}
+
+
+void
+flush_skip(struct flash_state *s)
+{
+    if (s->skip_end > s->skip_start) {
+	if (discard_blocks(s->out, s->out_regular, s->skip_start,
+		s->skip_end - s->skip_start) == 0) {
+	    error(errno, "can't discard blocks %llu to %llu, "
+		    "they keep their old contents",
+		    (unsigned long long) s->skip_start,
+		    (unsigned long long) s->skip_end - 1);
+	    discard_flag = 0;
+	} else {
+	    s->discarded += s->skip_end - s->skip_start;
+	}
+    }
+    s->skip_start = s->skip_end = 0;
+}
+
+
+int
+skip_blocks(struct flash_state *s, uint64_t start, uint64_t end)
+{
+    s->skipped += end - start;
+    if (!discard_flag) {
+	return 1;
+    }
+    if (start != s->skip_end) {
+	flush_skip(s);
+	s->skip_start = start;
+    }
+    s->skip_end = end;
+    return 1;
+}
+
+
+int
+write_run(struct flash_state *s, struct flash_buffer *b, uint32_t first,
+	uint32_t last, int zero)
+{
+	// zeros inside a partition must read back as zeros, which a
+	// discard doesn't promise; write them if the device can't clear
+    if (zero && zero_blocks(s->out, s->out_regular, b->block + first,
+	    last - first)) {
+	s->zeroed += last - first;
+	return 1;
+    }
+    if (write_blocks(s->out, b->block + first,
+	    b->buf + (size_t) first * PBLOCK_SIZE, last - first) == 0) {
+	return 0;
+    }
+    s->written += last - first;
+    return 1;
+}
+
+
+//
+// Write the non-zero runs of a buffer, each in a single write.
+//
+int
+flash_buffer(struct flash_state *s, struct flash_buffer *b)
+{
+    uint32_t first;
+    uint32_t i;
+    uint32_t n;
+    int zero;
+    int run_zero;
+
+    if (b->block > s->next) {
+	skip_blocks(s, s->next, b->block);
+    }
+    first = 0;
+    run_zero = 0;
+    for (i = 0; i < b->count; i += n) {
+	n = (b->count - i < FLASH_GRAIN)? b->count - i: FLASH_GRAIN;
+	zero = is_zero_block(b->buf + (size_t) i * PBLOCK_SIZE,
+		(size_t) n * PBLOCK_SIZE);
+	if (i > first && zero != run_zero) {
+	    if (write_run(s, b, first, i, run_zero) == 0) {
+		return 0;
+	    }
+	    first = i;
+	}
+	run_zero = zero;
+    }
+    if (b->count > first && write_run(s, b, first, b->count, run_zero) == 0) {
+	return 0;
+    }
+    s->next = (uint64_t) b->block + b->count;
+    return 1;
+}
+
+
+//
+// Write the used parts of image to device.  Returns 1 on success.
+//
+int
+flash_image(char *image, char *device)
+{
+    partition_map_header *map;
+    struct flash_state s;
+    struct flash_buffer *b;
+    struct stat in_info;
+    struct stat out_info;
+    pthread_t reader;
+    char *staged;
+    long staged_count;
+    uint64_t end;
+    long size;
+    int slot;
+    int stop;
+    int junk;
+    int result;
+    int i;
+
+    if (rflag) {
+	error(-1, "can't flash '%s' in read-only mode", device);
+	return 0;
+    }
+    map = open_partition_map(image, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    memset(&s, 0, sizeof(s));
+    staged = NULL;
+    s.in = map->fd;
+    s.count = collect_used(map, &s.list);
+    if (s.count < 0) {
+	close_partition_map(map);
+	return 0;
+    }
+    s.out = open(device, O_RDWR | O_CREAT, 0666);
+    if (s.out < 0) {
+	error(errno, "can't open '%s' for writing", device);
+	result = 0;
+	goto done;
+    }
+    if (fstat(s.in, &in_info) == 0 && fstat(s.out, &out_info) == 0
+	    && in_info.st_dev == out_info.st_dev
+	    && in_info.st_ino == out_info.st_ino) {
+	error(-1, "'%s' and '%s' are the same", image, device);
+	result = 0;
+	goto done;
+    }
+    s.out_regular = S_ISREG(out_info.st_mode);
+
+    end = (uint64_t) s.list[s.count - 1].start + s.list[s.count - 1].length;
+    size = compute_device_size(s.out);
+    if (s.out_regular && size < map->media_size) {
+	    // a new image file; what isn't written reads as zero
+	if (ftruncate(s.out, (off_t) map->media_size * PBLOCK_SIZE) < 0) {
+	    error(errno, "can't extend '%s'", device);
+	    result = 0;
+	    goto done;
+	}
+    } else if (size < end) {
+	error(-1, "the partitions of '%s' end at block %llu, past the end of "
+		"'%s' (%ld blocks)", image, (unsigned long long) end,
+		device, size);
+	result = 0;
+	goto done;
+    } else if (size < map->media_size) {
+	if (set_media_size(size, map) == 0) {
+	    error(-1, "can't fit the map of '%s' to '%s'", image, device);
+	    result = 0;
+	    goto done;
+	}
+	staged = stage_partition_map(map, &staged_count);
+	if (staged == NULL) {
+	    result = 0;
+	    goto done;
+	}
+    }
+
+    for (i = 0; i < FLASH_BUFFERS; i++) {
+	if (posix_memalign((void **)&s.buffers[i].buf, 4096,
+		FLASH_CHUNK * PBLOCK_SIZE) != 0) {
+	    error(errno, "can't allocate memory for disk buffers");
+	    s.buffers[i].buf = NULL;
+	    result = 0;
+	    goto done;
+	}
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.changed, NULL);
+    if (pthread_create(&reader, NULL, flash_reader, &s) != 0) {
+	error(errno, "can't start reader thread");
+	result = 0;
+	goto destroy;
+    }
+
+    slot = 0;
+    for (;;) {
+	b = &s.buffers[slot];
+	pthread_mutex_lock(&s.lock);
+	while (!b->full && !s.failed) {
+	    pthread_cond_wait(&s.changed, &s.lock);
+	}
+	stop = s.failed || b->count == 0;
+	pthread_mutex_unlock(&s.lock);
+	if (stop) {
+	    break;
+	}
+	result = flash_buffer(&s, b);
+	pthread_mutex_lock(&s.lock);
+	if (result) {
+	    b->full = 0;
+	} else {
+	    s.failed = 1;
+	}
+	pthread_cond_broadcast(&s.changed);
+	pthread_mutex_unlock(&s.lock);
+	slot = (slot + 1) % FLASH_BUFFERS;
+    }
+    pthread_join(reader, NULL);
+
+    result = !s.failed;
+    if (result) {
+	if (s.next < map->media_size) {
+	    skip_blocks(&s, s.next, map->media_size);
+	}
+	flush_skip(&s);
+	if (staged != NULL
+		&& write_blocks(s.out, 0, staged, staged_count) == 0) {
+	    result = 0;
+	} else if (fsync(s.out) < 0) {
+	    error(errno, "can't sync '%s'", device);
+	    result = 0;
+	}
+    }
+    if (result) {
+	printf("Flashed %s to %s: %llu blocks written, %llu zeroed, "
+		"%llu skipped", image, device, (unsigned long long) s.written,
+		(unsigned long long) s.zeroed, (unsigned long long) s.skipped);
+	if (s.discarded > 0) {
+	    printf(", %llu discarded", (unsigned long long) s.discarded);
+	}
+	printf("\n");
+    }
+
+destroy:
+    pthread_cond_destroy(&s.changed);
+    pthread_mutex_destroy(&s.lock);
+done:
+    for (i = 0; i < FLASH_BUFFERS; i++) {
+	free(s.buffers[i].buf);
+    }
+    if (s.out >= 0) {
+	close(s.out);
+    }
+    free(s.list);
+    free(staged);
+    close_partition_map(map);
+    return result;
+}
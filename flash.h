@@ -0,0 +1,29 @@
+//
+// flash.h - write an image to a device, skipping what isn't used
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int flash_image(char *image, char *device);
@@ -0,0 +1,363 @@
+//
+// fsprobe.c - identify the file system inside a partition
+//
+// The partition type only says what a partition was made for.  Here
+// the first few blocks of each partition are read and the superblock
+// found there decides.  The reads for all partitions of a map go out
+// as one batch, and the answer is kept with the entry until the
+// entry moves or goes away.
+//
+// For HFS and HFS+ volumes the name and space figures are taken from
+// the same block.  When only those are wanted (--volumes without
+// --probe) just that one block of each Apple_HFS partition is read.
+// An HFS wrapper is nearly all one file holding the HFS+ volume, so its
+// space figures come from the embedded volume's header, read in a
+// second batch.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "fsprobe.h"
+
+
+//
+// Defines
+//
+#define PROBE_BLOCKS	8	/* the first 4K holds every superblock we know */
+
+#define be16(p)		(((p)[0] << 8) | (p)[1])
+#define be32(p)		(((uint32_t) be16(p) << 16) | be16((p) + 2))
+#define le16(p)		(((p)[1] << 8) | (p)[0])
+#define le32(p)		(((uint32_t) le16((p) + 2) << 16) | le16(p))
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+const char *fs_names[] = {
+    "Unknown",
+    "HFS",
+    "HFS wrapper",
+    "HFS+",
+    "HFSX",
+    "ext2",
+    "ext3",
+    "ext4",
+    "Linux swap",
+    "FAT",
+    "FAT32",
+    "ProDOS"
+};
+
+
+//
+// Global Variables
+//
+int probe_flag;
+int volume_flag;
+
+
+//
+// Forward declarations
+//
+unsigned long embedded_header(partition_map *entry, unsigned char *mdb);
+int identify_fs(unsigned char *p, uint32_t length);
+int needs_probe(partition_map *entry);
+void read_embedded_info(partition_map_header *map, partition_map **entries,
+	char *buf, int count);
+void read_volume_info(struct fs_probe *probe, unsigned char *sb);
+
+
+//
+// Routines
+//
+const char *
+fs_name(int kind)
+{
+    if (kind < 0 || kind >= (int) (sizeof(fs_names) / sizeof(fs_names[0]))) {
+	kind = kFSUnknown;
+    }
+    return fs_names[kind];
+}
+
+
+//
+// p holds the first PROBE_BLOCKS blocks of a partition.
+//
+int
+identify_fs(unsigned char *p, uint32_t length)
+{
+    unsigned char *sb;
+
+    sb = p + 2 * PBLOCK_SIZE;
+    if (sb[0] == 'B' && sb[1] == 'D') {
+	if (be16(sb + 124) == 0x482B) {		// drEmbedSigWord 'H+'
+	    return kFSHFSWrapper;
+	}
+	return kFSHFS;
+    }
+    if (sb[0] == 'H' && sb[1] == '+' && be16(sb + 2) == 4) {
+	return kFSHFSPlus;
+    }
+    if (sb[0] == 'H' && sb[1] == 'X' && be16(sb + 2) == 5) {
+	return kFSHFSX;
+    }
+    if (le16(sb + 56) == 0xEF53) {
+	if (le32(sb + 0x60) & 0x2C0) {		// extents, 64bit, flex_bg
+	    return kFSExt4;
+	}
+	if (le32(sb + 0x5C) & 0x4) {		// has_journal
+	    return kFSExt3;
+	}
+	return kFSExt2;
+    }
+    if (length >= PROBE_BLOCKS
+	    && (memcmp(p + 4096 - 10, "SWAPSPACE2", 10) == 0
+	    || memcmp(p + 4096 - 10, "SWAP-SPACE", 10) == 0)) {
+	return kFSSwap;
+    }
+    if (p[510] == 0x55 && p[511] == 0xAA
+	    && (le16(p + 11) == 512 || le16(p + 11) == 1024
+	    || le16(p + 11) == 2048 || le16(p + 11) == 4096)) {
+	if (memcmp(p + 82, "FAT32", 5) == 0) {
+	    return kFSFAT32;
+	}
+	if (memcmp(p + 54, "FAT", 3) == 0) {
+	    return kFSFAT;
+	}
+    }
+    if (sb[0] == 0 && sb[1] == 0 && (sb[4] >> 4) == 0xF
+	    && sb[0x23] == 0x27 && sb[0x24] == 0x0D) {
+	return kFSProDOS;
+    }
+    return kFSUnknown;
+}
+
+
+void
+read_volume_info(struct fs_probe *probe, unsigned char *sb)
+{
+    int n;
+
+    probe->name[0] = 0;
+    probe->block_size = 0;
+    probe->total_blocks = 0;
+    probe->free_blocks = 0;
+    switch (probe->kind) {
+    case kFSHFS:
+    case kFSHFSWrapper:
+	n = sb[36];			// drVN
+	if (n > 27) {
+	    n = 27;
+	}
+	memcpy(probe->name, sb + 37, n);
+	probe->name[n] = 0;
+	probe->block_size = be32(sb + 20);	// drAlBlkSiz
+	probe->total_blocks = be16(sb + 18);	// drNmAlBlks
+	probe->free_blocks = be16(sb + 34);	// drFreeBks
+	break;
+    case kFSHFSPlus:
+    case kFSHFSX:
+	probe->block_size = be32(sb + 40);
+	probe->total_blocks = be32(sb + 44);
+	probe->free_blocks = be32(sb + 48);
+	break;
+    }
+}
+
+
+//
+// The block holding the header of the HFS+ volume embedded in the HFS
+// wrapper whose MDB is mdb, or 0 if it doesn't lie inside the partition.
+//
+unsigned long
+embedded_header(partition_map *entry, unsigned char *mdb)
+{
+    uint64_t start;
+    uint64_t length;
+    uint32_t per_block;
+
+    per_block = be32(mdb + 20) / PBLOCK_SIZE;	// drAlBlkSiz
+    if (per_block == 0) {
+	return 0;
+    }
+	// drAlBlSt is in blocks, drEmbedExtent in allocation blocks
+    start = be16(mdb + 28) + (uint64_t) be16(mdb + 126) * per_block;
+    length = (uint64_t) be16(mdb + 128) * per_block;
+    if (length < 3 || start + length > entry->data->dpme_pblocks) {
+	return 0;
+    }
+    return entry->data->dpme_pblock_start + start + 2;
+}
+
+
+//
+// Take the space figures of HFS wrappers from their embedded volumes.
+// buf holds the probe buffers of entries, as in probe_partitions().
+//
+void
+read_embedded_info(partition_map_header *map, partition_map **entries,
+	char *buf, int count)
+{
+    struct io_request *req;
+    unsigned char *mdb;
+    unsigned char *vh;
+    char *hdr;
+    int *which;
+    int n;
+    int i;
+
+    req = (struct io_request *) malloc(count * sizeof(struct io_request));
+    which = (int *) malloc(count * sizeof(int));
+    hdr = (char *) malloc((size_t) count * PBLOCK_SIZE);
+    if (req == NULL || which == NULL || hdr == NULL) {
+	error(errno, "can't allocate memory for probe buffers");
+	free(req);
+	free(which);
+	free(hdr);
+	return;
+    }
+    n = 0;
+    for (i = 0; i < count; i++) {
+	if (entries[i]->probe == NULL
+		|| entries[i]->probe->kind != kFSHFSWrapper) {
+	    continue;
+	}
+	mdb = (unsigned char *) buf + ((size_t) i * PROBE_BLOCKS + 2) * PBLOCK_SIZE;
+	req[n].block = embedded_header(entries[i], mdb);
+	if (req[n].block == 0) {
+	    continue;
+	}
+	req[n].count = 1;
+	req[n].buf = hdr + (size_t) n * PBLOCK_SIZE;
+	which[n] = i;
+	n++;
+    }
+    if (n > 0) {
+	read_batch(map->fd, req, n);
+    }
+    for (i = 0; i < n; i++) {
+	vh = (unsigned char *) req[i].buf;
+	if (req[i].ok && vh[0] == 'H' && vh[1] == '+') {
+	    entries[which[i]]->probe->block_size = be32(vh + 40);
+	    entries[which[i]]->probe->total_blocks = be32(vh + 44);
+	    entries[which[i]]->probe->free_blocks = be32(vh + 48);
+	}
+    }
+    free(req);
+    free(which);
+    free(hdr);
+}
+
+
+int
+needs_probe(partition_map *entry)
+{
+    DPME *p = entry->data;
+
+    if (!probe_flag && strncmp(p->dpme_type, "Apple_HFS", DPISTRLEN) != 0) {
+	return 0;
+    }
+    if (strncmp(p->dpme_type, kFreeType, DPISTRLEN) == 0
+	    || strncmp(p->dpme_type, kMapType, DPISTRLEN) == 0
+	    || p->dpme_pblocks < 3
+	    || (uint64_t) p->dpme_pblock_start + p->dpme_pblocks
+		> entry->the_map->media_size) {
+	return 0;
+    }
+    return entry->probe == NULL || entry->probe->base != p->dpme_pblock_start;
+}
+
+
+//
+// Probe every partition of map that has no current answer.
+//
+void
+probe_partitions(partition_map_header *map)
+{
+    partition_map * entry;
+    partition_map ** entries;
+    struct io_request *req;
+    char *buf;
+    unsigned char *p;
+    uint32_t blocks;
+    int count;
+    int i;
+
+    count = 0;
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	count += needs_probe(entry);
+    }
+    if (count == 0) {
+	return;
+    }
+    entries = (partition_map **) malloc(count * sizeof(partition_map *));
+    req = (struct io_request *) malloc(count * sizeof(struct io_request));
+    buf = (char *) malloc((size_t) count * PROBE_BLOCKS * PBLOCK_SIZE);
+    if (entries == NULL || req == NULL || buf == NULL) {
+	error(errno, "can't allocate memory for probe buffers");
+	free(entries);
+	free(req);
+	free(buf);
+	return;
+    }
+
+    i = 0;
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	if (needs_probe(entry) == 0) {
+	    continue;
+	}
+	blocks = entry->data->dpme_pblocks;
+	entries[i] = entry;
+	req[i].buf = buf + (size_t) i * PROBE_BLOCKS * PBLOCK_SIZE;
+	if (probe_flag) {
+	    req[i].block = entry->data->dpme_pblock_start;
+	    req[i].count = (blocks < PROBE_BLOCKS)? blocks: PROBE_BLOCKS;
+	} else {
+		// just the volume header, in its place in the buffer
+	    memset(req[i].buf, 0, PROBE_BLOCKS * PBLOCK_SIZE);
+	    req[i].block = entry->data->dpme_pblock_start + 2;
+	    req[i].count = 1;
+	    req[i].buf += 2 * PBLOCK_SIZE;
+	}
+	i++;
+    }
+    read_batch(map->fd, req, count);
+
+    for (i = 0; i < count; i++) {
+	entry = entries[i];
+	if (entry->probe == NULL) {
+	    entry->probe = (struct fs_probe *) malloc(sizeof(struct fs_probe));
+	    if (entry->probe == NULL) {
+		continue;
+	    }
+	}
+	entry->probe->base = entry->data->dpme_pblock_start;
+	entry->probe->kind = kFSUnknown;
+	p = (unsigned char *) buf + (size_t) i * PROBE_BLOCKS * PBLOCK_SIZE;
+	if (req[i].ok) {
+	    if (probe_flag && req[i].count < PROBE_BLOCKS) {
+		memset(p + req[i].count * PBLOCK_SIZE, 0,
+			(PROBE_BLOCKS - req[i].count) * PBLOCK_SIZE);
+	    }
+	    entry->probe->kind = identify_fs(p, (probe_flag)? req[i].count: 3);
+	}
+	read_volume_info(entry->probe, p + 2 * PBLOCK_SIZE);
+    }
+    read_embedded_info(map, entries, buf, count);
+    free(entries);
+    free(req);
+    free(buf);
+}
@@ -0,0 +1,62 @@
+//
+// fsprobe.h - identify the file system inside a partition
+//
+#ifndef fsprobe_h
+#define fsprobe_h
+
+#include <stdint.h>
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+enum fs_kinds {
+    kFSUnknown = 0,
+    kFSHFS,
+    kFSHFSWrapper,	// HFS volume wrapping an HFS Plus one
+    kFSHFSPlus,
+    kFSHFSX,
+    kFSExt2,
+    kFSExt3,
+    kFSExt4,
+    kFSSwap,
+    kFSFAT,
+    kFSFAT32,
+    kFSProDOS
+};
+
+struct fs_probe {
+    uint32_t base;	// partition base when probed; stale if it moved
+    int kind;
+	// HFS and HFS+ only
+    char name[28];	// empty for HFS+, whose name is in the catalog
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t free_blocks;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+extern int probe_flag;
+extern int volume_flag;
+
+
+//
+// Forward declarations
+//
+const char* fs_name(int kind);
+void probe_partitions(partition_map_header *map);
+
+#endif
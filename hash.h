@@ -0,0 +1,36 @@
+//
+// hash.h - fast non-cryptographic hashing
+//
+#ifndef hash_h
+#define hash_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+#endif
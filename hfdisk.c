@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include <sys/ioctl.h>
 
@@ -42,7 +43,23 @@
 #include "errors.h"
 #include "partition_map.h"
 #include "dump.h"
+#include "cache.h"
+#include "check.h"
+#include "digest.h"
+#include "discard.h"
+#include "drivers.h"
+#include "extract.h"
+#include "flash.h"
+#include "fsprobe.h"
+#include "layout.h"
+#include "output.h"
+#include "recover.h"
+#include "relocate.h"
+#include "scan.h"
+#include "sparse.h"
+#include "template.h"
 #include "version.h"
+#include "wipe.h"
 
 
 //
@@ -63,7 +80,37 @@ enum getopt_values {
     kLongOption = 0,
     kBadOption = '?',
     kOptionArg = 1000,
-    kListOption = 1001
+    kListOption = 1001,
+    kCaptureOption = 1002,
+    kStampOption = 1003,
+    kFormatOption = 1004,
+    kScanOption = 1005,
+    kJobsOption = 1006,
+    kCacheOption = 1007,
+    kVerifyCacheOption = 1008,
+    kCheckOption = 1009,
+    kRecoverOption = 1010,
+    kProbeOption = 1011,
+    kVolumesOption = 1012,
+    kVerifyDriversOption = 1013,
+    kSparsifyOption = 1014,
+    kDiscardOption = 1015,
+    kWipeOption = 1016,
+    kVerifyOption = 1017,
+    kHashOption = 1018,
+    kMoveOption = 1019,
+    kResizeOption = 1020,
+    kCheckpointOption = 1021,
+    kGrowMapOption = 1022,
+    kExtractOption = 1023,
+    kInjectOption = 1024,
+    kFlashOption = 1025,
+    kFillOption = 1026,
+    kShrinkOption = 1027,
+    kAlignOption = 1028,
+    kLayoutOption = 1029,
+    kCompactOption = 1030,
+    kCloneLayoutOption = 1031
 };
 
 const NAMES plist[] = {
@@ -89,6 +136,28 @@ int vflag;
 int hflag;
 int dflag;
 int rflag;
+char *capture_file;
+char *stamp_file;
+char *clone_source;
+int scan_flag;
+int check_flag;
+int recover_flag;
+int verify_drivers_flag;
+int hash_flag;
+long move_index;
+long move_base;
+long move_length;
+long grow_map_size;
+char *extract_which;
+char *inject_which;
+int flash_flag;
+int fill_flag;
+char *fill_which;
+int shrink_flag;
+char *layout_file;
+int compact_flag;
+int sparsify_flag;
+int jobs;
 
 
 //
@@ -99,10 +168,10 @@ void do_change_map_size(partition_map_header *map);
 void do_create_partition(partition_map_header *map, int get_type);
 void do_create_bootstrap_partition(partition_map_header *map);
 void do_delete_partition(partition_map_header *map);
-int do_expert(partition_map_header *map);
+int do_expert(partition_map_header *map, int *result);
 void do_reorder(partition_map_header *map);
-void do_write_partition_map(partition_map_header *map);
-void edit(char *name);
+int do_write_partition_map(partition_map_header *map);
+int edit(char *name);
 int get_base_argument(long *number, partition_map_header *map);
 int get_size_argument(uint32_t base, long *number, partition_map_header *map);
 int get_options(int argc, char **argv);
@@ -146,9 +215,189 @@ main(int argc, char **argv)
 	} else {
 	    list_all_disks();
 	}
+    } else if (scan_flag) {
+	if (name_index >= argc) {
+	    usage("no directory argument");
+	    do_help();
+	    err=-EINVAL;
+	} else if (scan_images(argv + name_index, argc - name_index, jobs) < 0) {
+	    err=1;
+	}
+    } else if (check_flag) {
+	if (name_index >= argc) {
+	    usage("no device argument");
+	    do_help();
+	    err=-EINVAL;
+	}
+	while (name_index < argc) {
+	    if (check_partition_map(argv[name_index++]) != 0) {
+		err=1;
+	    }
+	}
+    } else if (verify_drivers_flag) {
+	if (name_index >= argc) {
+	    usage("no device argument");
+	    do_help();
+	    err=-EINVAL;
+	} else if (verify_drivers(argv + name_index, argc - name_index,
+		jobs) != 0) {
+	    err=1;
+	}
+    } else if (hash_flag) {
+	if (name_index >= argc) {
+	    usage("no device argument");
+	    do_help();
+	    err=-EINVAL;
+	} else if (hash_partitions(argv + name_index, argc - name_index,
+		jobs) == 0) {
+	    err=1;
+	}
+    } else if (sparsify_flag) {
+	if (name_index >= argc) {
+	    usage("no image argument");
+	    do_help();
+	    err=-EINVAL;
+	}
+	while (name_index < argc) {
+	    if (sparsify_image(argv[name_index++], sparsify_flag > 1) == 0) {
+		err=1;
+	    }
+	}
+    } else if (recover_flag) {
+	if (name_index >= argc) {
+	    usage("no device argument");
+	    do_help();
+	    err=-EINVAL;
+	}
+	while (name_index < argc) {
+	    if (recover_partition_map(argv[name_index++]) == 0) {
+		err=1;
+	    }
+	}
+    } else if (move_index > 0) {
+	wipe_flag = 0;	// the data moved is not stale
+	if (name_index + 1 != argc) {
+	    usage("move and resize need exactly one device argument");
+	    do_help();
+	    err=-EINVAL;
+	} else if (move_partition(argv[name_index], move_index, move_base,
+		move_length) == 0) {
+	    err=1;
+	}
+    } else if (grow_map_size > 0) {
+	wipe_flag = 0;
+	if (name_index + 1 != argc) {
+	    usage("grow-map needs exactly one device argument");
+	    do_help();
+	    err=-EINVAL;
+	} else if (grow_map(argv[name_index], grow_map_size) == 0) {
+	    err=1;
+	}
+    } else if (fill_flag) {
+	if (name_index >= argc) {
+	    usage("no device argument");
+	    do_help();
+	    err=-EINVAL;
+	}
+	while (name_index < argc) {
+	    if (fill_medium(argv[name_index++], fill_which) == 0) {
+		err=1;
+	    }
+	}
+    } else if (shrink_flag) {
+	if (name_index >= argc) {
+	    usage("no image argument");
+	    do_help();
+	    err=-EINVAL;
+	}
+	while (name_index < argc) {
+	    if (shrink_image(argv[name_index++]) == 0) {
+		err=1;
+	    }
+	}
+    } else if (compact_flag) {
+	if (name_index >= argc) {
+	    usage("no device argument");
+	    do_help();
+	    err=-EINVAL;
+	}
+	while (name_index < argc) {
+	    if (compact_map(argv[name_index++], compact_flag > 1) == 0) {
+		err=1;
+	    }
+	}
+    } else if (layout_file != NULL) {
+	if (name_index >= argc) {
+	    usage("no device argument");
+	    do_help();
+	    err=-EINVAL;
+	}
+	while (name_index < argc) {
+	    if (apply_layout(layout_file, argv[name_index++]) == 0) {
+		err=1;
+	    }
+	}
+    } else if (extract_which != NULL) {
+	if (name_index + 2 != argc) {
+	    usage("extract needs a device and a file argument");
+	    do_help();
+	    err=-EINVAL;
+	} else if (extract_partition(argv[name_index], extract_which,
+		argv[name_index + 1]) == 0) {
+	    err=1;
+	}
+    } else if (inject_which != NULL) {
+	if (name_index + 2 != argc) {
+	    usage("inject needs a device and a file argument");
+	    do_help();
+	    err=-EINVAL;
+	} else if (inject_partition(argv[name_index], inject_which,
+		argv[name_index + 1]) == 0) {
+	    err=1;
+	}
+    } else if (flash_flag) {
+	if (name_index + 2 != argc) {
+	    usage("flash needs an image and a device argument");
+	    do_help();
+	    err=-EINVAL;
+	} else if (flash_image(argv[name_index], argv[name_index + 1]) == 0) {
+	    err=1;
+	}
+    } else if (capture_file != NULL) {
+	if (name_index + 1 != argc) {
+	    usage("capture needs exactly one device argument");
+	    do_help();
+	    err=-EINVAL;
+	} else if (capture_template(argv[name_index], capture_file) == 0) {
+	    err=1;
+	}
+    } else if (stamp_file != NULL) {
+	if (name_index >= argc) {
+	    usage("no device argument");
+	    do_help();
+	    err=-EINVAL;
+	}
+	while (name_index < argc) {
+	    if (stamp_template(stamp_file, argv[name_index++]) == 0) {
+		err=1;
+	    }
+	}
+    } else if (clone_source != NULL) {
+	if (name_index >= argc) {
+	    usage("no device argument");
+	    do_help();
+	    err=-EINVAL;
+	}
+	while (name_index < argc) {
+	    if (clone_layout(clone_source, argv[name_index++]) == 0) {
+		err=1;
+	    }
+	}
     } else if (name_index < argc) {
 	while (name_index < argc) {
-	    edit(argv[name_index++]);
+	    if (edit(argv[name_index++]) == 0) {
+		err=1;
+	    }
 	}
     } else if (!vflag) {
 	usage("no device argument");
@@ -163,6 +412,7 @@ int
 get_options(int argc, char **argv)
 {
     int c;
+    long index;
     static struct option long_options[] =
     {
 	// name		has_arg			&flag	val
@@ -171,6 +421,36 @@ get_options(int argc, char **argv)
 	{"version",	no_argument,		0,	'v'},
 	{"debug",	no_argument,		0,	'd'},
 	{"readonly",	no_argument,		0,	'r'},
+	{"capture-template", required_argument,	0,	kCaptureOption},
+	{"stamp-template", required_argument,	0,	kStampOption},
+	{"format",	required_argument,	0,	kFormatOption},
+	{"scan",	no_argument,		0,	kScanOption},
+	{"jobs",	required_argument,	0,	kJobsOption},
+	{"cache",	required_argument,	0,	kCacheOption},
+	{"verify-cache", no_argument,		0,	kVerifyCacheOption},
+	{"check",	no_argument,		0,	kCheckOption},
+	{"recover",	no_argument,		0,	kRecoverOption},
+	{"probe",	no_argument,		0,	kProbeOption},
+	{"volumes",	no_argument,		0,	kVolumesOption},
+	{"verify-drivers", no_argument,		0,	kVerifyDriversOption},
+	{"sparsify",	optional_argument,	0,	kSparsifyOption},
+	{"discard",	no_argument,		0,	kDiscardOption},
+	{"wipe-signatures", no_argument,	0,	kWipeOption},
+	{"verify",	no_argument,		0,	kVerifyOption},
+	{"hash",	no_argument,		0,	kHashOption},
+	{"move",	required_argument,	0,	kMoveOption},
+	{"resize",	required_argument,	0,	kResizeOption},
+	{"checkpoint",	required_argument,	0,	kCheckpointOption},
+	{"grow-map",	required_argument,	0,	kGrowMapOption},
+	{"extract",	required_argument,	0,	kExtractOption},
+	{"inject",	required_argument,	0,	kInjectOption},
+	{"flash",	no_argument,		0,	kFlashOption},
+	{"fill",	optional_argument,	0,	kFillOption},
+	{"shrink",	no_argument,		0,	kShrinkOption},
+	{"align",	required_argument,	0,	kAlignOption},
+	{"layout",	required_argument,	0,	kLayoutOption},
+	{"compact",	optional_argument,	0,	kCompactOption},
+	{"clone-layout", required_argument,	0,	kCloneLayoutOption},
 	{0, 0, 0, 0}
     };
     int option_index = 0;
@@ -186,6 +466,37 @@ get_options(int argc, char **argv)
     hflag = 0;
     dflag = 0;
     rflag = 0;
+    capture_file = NULL;
+    stamp_file = NULL;
+    clone_source = NULL;
+    scan_flag = 0;
+    check_flag = 0;
+    recover_flag = 0;
+    verify_drivers_flag = 0;
+    hash_flag = 0;
+    move_index = 0;
+    move_base = -1;
+    move_length = 0;
+    grow_map_size = 0;
+    extract_which = NULL;
+    inject_which = NULL;
+    flash_flag = 0;
+    fill_flag = 0;
+    fill_which = NULL;
+    shrink_flag = 0;
+    layout_file = NULL;
+    compact_flag = 0;
+    checkpoint_file = NULL;
+    sparsify_flag = 0;
+    discard_flag = 0;
+    wipe_flag = 0;
+    verify_flag = 0;
+    align_blocks = 0;
+    probe_flag = 0;
+    volume_flag = 0;
+    jobs = 0;
+    cache_file = NULL;
+    verify_cache = 0;
 
     optind = 0;	// reset option scanner logic
     while ((c = getopt_long(argc, argv, "hlvdr", long_options,
@@ -214,6 +525,134 @@ get_options(int argc, char **argv)
 	case 'r':
 	    rflag = 1;
 	    break;
+	case kCaptureOption:
+	    capture_file = optarg;
+	    break;
+	case kStampOption:
+	    stamp_file = optarg;
+	    break;
+	case kCloneLayoutOption:
+	    clone_source = optarg;
+	    break;
+	case kScanOption:
+	    scan_flag = 1;
+	    rflag = 1;
+	    break;
+	case kCheckOption:
+	    check_flag = 1;
+	    rflag = 1;
+	    break;
+	case kVerifyDriversOption:
+	    verify_drivers_flag = 1;
+	    rflag = 1;
+	    break;
+	case kHashOption:
+	    hash_flag = 1;
+	    rflag = 1;
+	    break;
+	case kMoveOption:
+	    if (parse_relocation(optarg, &index, &move_base) == 0
+		    || (move_index != 0 && index != move_index)) {
+		flag = 1;
+	    }
+	    move_index = index;
+	    break;
+	case kResizeOption:
+	    if (parse_relocation(optarg, &index, &move_length) == 0
+		    || move_length == 0
+		    || (move_index != 0 && index != move_index)) {
+		flag = 1;
+	    }
+	    move_index = index;
+	    break;
+	case kCheckpointOption:
+	    checkpoint_file = optarg;
+	    break;
+	case kGrowMapOption:
+	    grow_map_size = atol(optarg);
+	    if (grow_map_size < 2) {
+		flag = 1;
+	    }
+	    break;
+	case kExtractOption:
+	    extract_which = optarg;
+	    rflag = 1;
+	    break;
+	case kInjectOption:
+	    inject_which = optarg;
+	    break;
+	case kFlashOption:
+	    flash_flag = 1;
+	    break;
+	case kFillOption:
+	    fill_flag = 1;
+	    fill_which = optarg;
+	    break;
+	case kShrinkOption:
+	    shrink_flag = 1;
+	    break;
+	case kCompactOption:
+	    if (optarg == NULL) {
+		compact_flag = 1;
+	    } else if (strcmp(optarg, "shrink") == 0) {
+		compact_flag = 2;
+	    } else {
+		flag = 1;
+	    }
+	    break;
+	case kLayoutOption:
+	    layout_file = optarg;
+	    break;
+	case kAlignOption:
+	    if (parse_blocks(optarg, &align_blocks) == 0 || align_blocks < 1) {
+		flag = 1;
+	    }
+	    break;
+	case kDiscardOption:
+	    discard_flag = 1;
+	    break;
+	case kWipeOption:
+	    wipe_flag = 1;
+	    break;
+	case kVerifyOption:
+	    verify_flag = 1;
+	    break;
+	case kSparsifyOption:
+	    if (optarg == NULL) {
+		sparsify_flag = 1;
+	    } else if (strcmp(optarg, "free") == 0) {
+		sparsify_flag = 2;
+	    } else {
+		flag = 1;
+	    }
+	    break;
+	case kRecoverOption:
+	    recover_flag = 1;
+	    break;
+	case kProbeOption:
+	    probe_flag = 1;
+	    break;
+	case kVolumesOption:
+	    volume_flag = 1;
+	    break;
+	case kJobsOption:
+	    jobs = atoi(optarg);
+	    if (jobs <= 0) {
+		flag = 1;
+	    }
+	    break;
+	case kCacheOption:
+	    cache_file = optarg;
+	    break;
+	case kVerifyCacheOption:
+	    verify_cache = 1;
+	    break;
+	case kFormatOption:
+	    if ((output_format = parse_output_format(optarg)) < 0) {
+		output_format = kTextFormat;
+		flag = 1;
+	    }
+	    break;
 	case kBadOption:
 	default:
 	    flag = 1;
@@ -227,9 +666,10 @@ get_options(int argc, char **argv)
 }
 
 //
-// Edit the file
+// Edit the file.  Returns 0 if it couldn't be opened or a write of the
+// map failed.
 //
-void
+int
 edit(char *name)
 {
     partition_map_header *map;
@@ -238,10 +678,11 @@ edit(char *name)
     int order;
     int get_type;
     int valid_file;
+    int result = 1;
 
     map = open_partition_map(name, &valid_file);
     if (!valid_file) {
-    	return;
+    	return 0;
     }
 
     printf("%s\n", name);
@@ -315,14 +756,16 @@ edit(char *name)
 	case 'x':
 	    if (!dflag) {
 		goto do_error;
-	    } else if (do_expert(map)) {
+	    } else if (do_expert(map, &result)) {
 		goto finis;
 	    }
 	    break;
 	case 'W':
 	case 'w':
 	    if (!rflag) {
-		do_write_partition_map(map);
+		if (do_write_partition_map(map) == 0) {
+		    result = 0;
+		}
 		break;
 	    }
 	default:
@@ -334,6 +777,7 @@ edit(char *name)
 finis:
 
     close_partition_map(map);
+    return result;
 }
 
 
@@ -429,6 +873,10 @@ get_base_argument(long *number, partition_map_header *map)
     if (get_number_argument(prompt, number, defaultFirstBlock) == 0) {
 	bad_input("Bad block number");
     } else {
+	    // a script types its bases, so align them as the default is
+	if (!isatty(0) && *number > 0) {
+	    *number = align_block(*number, map);
+	}
 	result = 1;
     }
     return result;
@@ -441,6 +889,7 @@ get_size_argument(uint32_t base, long *number, partition_map_header *map)
     int result = 0;
 
     uint32_t defaultSize = 20480; // 10MB
+    uint32_t defaultRoom = 0;
 
     // Work out how much free-space is available.
     partition_map* part = find_entry_by_sector(base, map);
@@ -450,6 +899,11 @@ get_size_argument(uint32_t base, long *number, partition_map_header *map)
 	    part->data->dpme_pblock_start +
 	    part->data->dpme_pblocks;
 	defaultSize = partEnd - base;
+	defaultRoom = defaultSize;
+	// whole alignment units, where there is room for one
+	if (defaultSize >= map->alignment) {
+	    defaultSize -= defaultSize % map->alignment;
+	}
     }
 
     char prompt[80];
@@ -461,6 +915,15 @@ get_size_argument(uint32_t base, long *number, partition_map_header *map)
     if (get_number_argument(prompt, number, defaultSize) == 0) {
 	bad_input("Bad length");
     } else {
+	    // and cuts its lengths to whole units within the free space
+	if (!isatty(0) && *number >= (long)map->alignment) {
+	    if (part && *number > (long)defaultRoom) {
+		*number = defaultRoom;
+	    }
+	    if (*number >= (long)map->alignment) {
+		*number -= *number % map->alignment;
+	    }
+	}
 	result = 1;
     }
     return result;
@@ -521,20 +984,23 @@ do_reorder(partition_map_header *map)
 }
 
 
-void
+//
+// Returns 0 only if the map was written and the write failed.
+//
+int
 do_write_partition_map(partition_map_header *map)
 {
     if (map == NULL) {
 	bad_input("No partition map exists");
-	return;
+	return 1;
     }
     if (map->changed == 0) {
 	bad_input("The map has not been changed.");
-	return;
+	return 1;
     }
     if (map->writeable == 0) {
 	bad_input("The map is not writeable.");
-	return;
+	return 1;
     }
 //    printf("Writing the map destroys what was there before. ");
     printf("IMPORTANT: You are about to write a changed partition map to disk. \n");
@@ -543,20 +1009,23 @@ do_write_partition_map(partition_map_header *map)
     printf("Make sure you have a backup of any data on such partitions you \n");
     printf("want to keep before answering 'yes' to the question below! \n\n");
     if (get_okay("Write partition map? [N/y]: ") != 1) {
-	return;
+	return 1;
     }
 
-    write_partition_map(map);
+    if (write_partition_map(map) == 0) {
+	return 0;
+    }
 
     printf("\nPartition map written to disk. If any partitions on this disk \n");
     printf("were still in use by the system (see messages above), you will need \n");
     printf("to reboot in order to utilize the new partition map.\n\n");
 
     // exit(0);
+    return 1;
 }
 
 int
-do_expert(partition_map_header *map)
+do_expert(partition_map_header *map, int *result)
 {
     int command;
     int first = 0;
@@ -608,7 +1077,9 @@ do_expert(partition_map_header *map)
 	case 'W':
 	case 'w':
 	    if (!rflag) {
-		do_write_partition_map(map);
+		if (do_write_partition_map(map) == 0) {
+		    *result = 0;
+		}
 		break;
 	    }
 	default:
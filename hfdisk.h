@@ -49,6 +49,7 @@ extern const NAMES plist[];
 //
 // Global Variables
 //
+extern int lflag;
 extern int rflag;
 extern int hflag;
 
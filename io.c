@@ -25,6 +25,8 @@
  * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. 
  */
 
+#define _GNU_SOURCE	// for O_DIRECT
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -37,6 +39,7 @@
 #include "hfdisk.h"
 #include "io.h"
 #include "errors.h"
+#include "pool.h"
 
 
 //
@@ -45,10 +48,16 @@
 #define BAD_DIGIT 17	/* must be greater than any base */
 #define	STRING_CHUNK	16
 #define UNGET_MAX_COUNT 10
+#define DIRECT_ALIGN	4096	/* covers any logical block size */
 
 //
 // Types
 //
+struct io_batch {
+    int fd;
+    struct io_request *req;
+    int write;
+};
 
 
 //
@@ -65,6 +74,8 @@ const long kDefault = -1;
 //
 // Forward declarations
 //
+void batch_task(long task, int worker, void *arg);
+int run_batch(int fd, struct io_request *req, int count, int write);
 
 
 //
@@ -213,50 +224,226 @@ bad_input(char *fmt, ...)
 int
 read_block(int fd, unsigned long num, char *buf, int quiet)
 {
-    off_t x;
-    long t;
+    return read_blocks(fd, num, buf, 1, quiet);
+}
 
-    {
-	x = ((long long) num * PBLOCK_SIZE); /* cast to ll to work around compiler bug */
-	if ((x = lseek(fd, x, 0)) < 0) {
-	    if (quiet == 0) {
-		error(errno, "Can't seek on file");
+
+int
+write_block(int fd, unsigned long num, char *buf)
+{
+    return write_blocks(fd, num, buf, 1);
+}
+
+
+//
+// Read or write count consecutive blocks starting at num in a single
+// request.  Short transfers are retried so that large requests against
+// devices that split I/O still complete.
+//
+int
+read_blocks(int fd, unsigned long num, char *buf, unsigned long count, int quiet)
+{
+    off_t x;
+    size_t len;
+    size_t done;
+    ssize_t t;
+
+    x = ((off_t) num * PBLOCK_SIZE);
+    len = count * PBLOCK_SIZE;
+    for (done = 0; done < len; done += t) {
+	t = pread(fd, buf + done, len - done, x + done);
+	if (t <= 0) {
+	    if (t < 0 && errno == EINTR) {
+		t = 0;
+		continue;
 	    }
-	    return 0;
-	}
-	if ((t = read(fd, buf, PBLOCK_SIZE)) != PBLOCK_SIZE) {
 	    if (quiet == 0) {
-		error((t<0?errno:0), "Can't read block %u from file", num);
+		error((t<0?errno:0), "Can't read block %lu from file",
+			num + done / PBLOCK_SIZE);
 	    }
 	    return 0;
 	}
-	return 1;
     }
+    return 1;
 }
 
 
 int
-write_block(int fd, unsigned long num, char *buf)
+write_blocks(int fd, unsigned long num, char *buf, unsigned long count)
 {
     off_t x;
-    long t;
+    size_t len;
+    size_t done;
+    ssize_t t;
 
     if (rflag) {
 	printf("Can't write block %lu to file", num);
 	return 0;
     }
-    {
-	x = num * PBLOCK_SIZE;
-	if ((x = lseek(fd, x, 0)) < 0) {
-	    error(errno, "Can't seek on file");
+    x = ((off_t) num * PBLOCK_SIZE);
+    len = count * PBLOCK_SIZE;
+    for (done = 0; done < len; done += t) {
+	t = pwrite(fd, buf + done, len - done, x + done);
+	if (t <= 0) {
+	    if (t < 0 && errno == EINTR) {
+		t = 0;
+		continue;
+	    }
+	    error((t<0?errno:0), "Can't write block %lu to file",
+		    num + done / PBLOCK_SIZE);
 	    return 0;
 	}
-	if ((t = write(fd, buf, PBLOCK_SIZE)) != PBLOCK_SIZE) {
-	    error((t<0?errno:0), "Can't write block %u to file", num);
-	    return 0;
+    }
+    return 1;
+}
+
+
+void
+batch_task(long task, int worker, void *arg)
+{
+    struct io_batch *batch = (struct io_batch *) arg;
+    struct io_request *r = &batch->req[task];
+
+    if (batch->write) {
+	r->ok = write_blocks(batch->fd, r->block, r->buf, r->count);
+    } else {
+	r->ok = read_blocks(batch->fd, r->block, r->buf, r->count, 1);
+    }
+}
+
+
+//
+// Carry out a batch of independent transfers on IO_BATCH_WORKERS
+// threads, each with its own pread or pwrite in flight, so a device
+// with a queue has that many to work on at once.  (glibc's POSIX aio
+// would run requests on one descriptor one after another.)  Each
+// request's ok is set if it completed in full.  Returns the number of
+// requests that completed.
+//
+int
+run_batch(int fd, struct io_request *req, int count, int write)
+{
+    struct io_batch batch;
+    int done;
+    int i;
+
+    batch.fd = fd;
+    batch.req = req;
+    batch.write = write;
+    if (count == 1 || run_pool(count, IO_BATCH_WORKERS, batch_task,
+	    &batch) == 0) {
+	for (i = 0; i < count; i++) {
+	    batch_task(i, 0, &batch);
+	}
+    }
+    done = 0;
+    for (i = 0; i < count; i++) {
+	done += req[i].ok;
+    }
+    return done;
+}
+
+
+int
+read_batch(int fd, struct io_request *req, int count)
+{
+    return run_batch(fd, req, count, 0);
+}
+
+
+int
+write_batch(int fd, struct io_request *req, int count)
+{
+    int i;
+
+    if (rflag) {
+	for (i = 0; i < count; i++) {
+	    req[i].ok = 0;
 	}
-	return 1;
+	return 0;
     }
+    return run_batch(fd, req, count, 1);
+}
+
+
+//
+// Read count blocks at num back from the medium itself rather than
+// the page cache and compare them with buf.  What fd has written is
+// flushed first.  If name can't be opened for direct I/O its cached
+// pages are dropped and it is read normally.  Returns 1 if the blocks
+// match.
+//
+int
+verify_blocks(int fd, const char *name, unsigned long num, const char *buf,
+	unsigned long count)
+{
+    char *copy;
+    off_t start;
+    size_t skip;
+    size_t len;
+    size_t done;
+    ssize_t t;
+    unsigned long i;
+    int vfd;
+    int result;
+
+    if (fsync(fd) < 0) {
+	error(errno, "can't flush '%s' to the medium", name);
+	return 0;
+    }
+    start = (off_t) num * PBLOCK_SIZE;
+    skip = start % DIRECT_ALIGN;
+    start -= skip;
+    len = skip + count * PBLOCK_SIZE;
+    len = (len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    if (posix_memalign((void **)&copy, DIRECT_ALIGN, len) != 0) {
+	error(errno, "can't allocate memory for verify buffer");
+	return 0;
+    }
+    vfd = open(name, O_RDONLY | O_DIRECT);
+    if (vfd < 0) {
+	vfd = open(name, O_RDONLY);
+	if (vfd >= 0) {
+	    posix_fadvise(vfd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+    }
+    if (vfd < 0) {
+	error(errno, "can't open file '%s' to verify", name);
+	free(copy);
+	return 0;
+    }
+
+	// a direct read may stop short at the end of the medium
+    t = 0;
+    for (done = 0; done < len; done += t) {
+	t = pread(vfd, copy + done, len - done, start + done);
+	if (t < 0 && errno == EINTR) {
+	    t = 0;
+	    continue;
+	}
+	if (t <= 0) {
+	    break;
+	}
+    }
+    result = 1;
+    if (done < skip + count * PBLOCK_SIZE) {
+	error((t < 0)? errno: 0, "can't read block %lu of '%s' back",
+		num + (done > skip? done - skip: 0) / PBLOCK_SIZE, name);
+	result = 0;
+    } else {
+	for (i = 0; i < count; i++) {
+	    if (memcmp(copy + skip + i * PBLOCK_SIZE, buf + i * PBLOCK_SIZE,
+		    PBLOCK_SIZE) != 0) {
+		error(-1, "block %lu of '%s' does not read back as written",
+			num + i, name);
+		result = 0;
+		break;
+	    }
+	}
+    }
+    close(vfd);
+    free(copy);
+    return result;
 }
 
 
@@ -30,11 +30,18 @@
 // Defines
 //
 #define	PBLOCK_SIZE	512
+#define	IO_BATCH_WORKERS 8	/* transfers of a batch in flight at once */
 
 
 //
 // Types
 //
+struct io_request {
+    unsigned long block;
+    unsigned long count;
+    char *buf;
+    int ok;
+};
 
 
 //
@@ -59,5 +66,11 @@ int get_okay(char *prompt);
 int get_string_argument(char *prompt, char **string, int reprompt);
 int number_of_digits(unsigned long value);
 int open_device(const char *path, int oflag);
+int read_batch(int fd, struct io_request *req, int count);
 int read_block(int fd, unsigned long num, char *buf, int quiet);
+int read_blocks(int fd, unsigned long num, char *buf, unsigned long count, int quiet);
+int verify_blocks(int fd, const char *name, unsigned long num, const char *buf,
+	unsigned long count);
+int write_batch(int fd, struct io_request *req, int count);
 int write_block(int fd, unsigned long num, char *buf);
+int write_blocks(int fd, unsigned long num, char *buf, unsigned long count);
@@ -0,0 +1,554 @@
+//
+// layout.c - place a list of partitions in the free space of a map
+//
+// A layout file has one partition per line:
+//
+//	name type size [align]
+//
+// where size is a number of blocks (with a k, m or g suffix), a
+// percentage of the free space, or "rest", which at most one line may
+// use.  Blank lines and lines starting with # are ignored.
+//
+// The whole layout is planned before the map is touched.  Partitions
+// go first-fit into the free extents in the order given, each on its
+// own alignment.  The rest partition takes the largest extent that is
+// left; the partitions after it that fit nowhere else are packed at
+// the end of that extent, and it gets what is between.  Then the plan
+// is checked against the room in the map, added, and written once.  A
+// device with no map gets a new one with room for every entry the
+// layout can produce.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "relocate.h"
+#include "layout.h"
+
+
+//
+// Defines
+//
+#define LAYOUT_LINE	256
+
+
+//
+// Types
+//
+enum size_kind {
+    kBlocks,
+    kPercent,
+    kRest
+};
+
+struct layout_request {
+    char name[DPISTRLEN + 1];
+    char type[DPISTRLEN + 1];
+    enum size_kind kind;
+    long size;
+    long align;
+    long extent;		// where it was placed, or -1
+    uint32_t base;
+    uint32_t length;
+};
+
+struct layout {
+    struct layout_request *list;
+    int count;
+    int size;
+    int rest;			// index of the rest request, or -1
+};
+
+struct free_extent {
+    uint64_t cursor;		// first block not yet planned
+    uint64_t start;
+    uint64_t end;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+uint64_t align_down(uint64_t block, long align);
+uint64_t align_up(uint64_t block, long align);
+long count_layout_entries(struct layout *l, struct free_extent *e, int count);
+int place_first_fit(struct layout_request *r, struct free_extent *e,
+	int count, long skip);
+int place_rest(struct layout *l, struct free_extent *e, int count,
+	int first);
+int plan_layout(struct layout *l, struct free_extent *e, int count);
+int read_layout(char *file, struct layout *l);
+const char* resolve_type(const char *type);
+
+
+//
+// Routines
+//
+uint64_t
+align_up(uint64_t block, long align)
+{
+    return (block + align - 1) / align * align;
+}
+
+
+uint64_t
+align_down(uint64_t block, long align)
+{
+    return block / align * align;
+}
+
+
+//
+// Known abbreviations, as the editor lists them, stand for their type.
+//
+const char*
+resolve_type(const char *type)
+{
+    const char *abbr;
+    int i;
+
+    for (i = 0; plist[i].abbr != NULL; i++) {
+	for (abbr = plist[i].abbr; *abbr == ' '; abbr++) {
+	}
+	if (strcmp(type, abbr) == 0) {
+	    return plist[i].full;
+	}
+    }
+    return type;
+}
+
+
+int
+read_layout(char *file, struct layout *l)
+{
+    struct layout_request *r;
+    FILE *f;
+    char line[LAYOUT_LINE];
+    char name[LAYOUT_LINE];
+    char type[LAYOUT_LINE];
+    char size[LAYOUT_LINE];
+    char align[LAYOUT_LINE];
+    char *end;
+    const char *full;
+    int fields;
+    int number;
+
+    f = (strcmp(file, "-") == 0)? stdin: fopen(file, "r");
+    if (f == NULL) {
+	error(errno, "can't open layout file '%s'", file);
+	return 0;
+    }
+    memset(l, 0, sizeof(*l));
+    l->rest = -1;
+    number = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+	number++;
+	fields = sscanf(line, "%s %s %s %s", name, type, size, align);
+	if (fields <= 0 || name[0] == '#') {
+	    continue;
+	}
+	if (fields < 3) {
+	    error(-1, "%s:%d: expected name, type and size", file, number);
+	    goto fail;
+	}
+	if (l->count >= l->size) {
+	    l->size = (l->size == 0)? 16: l->size * 2;
+	    r = (struct layout_request *) realloc(l->list,
+		    l->size * sizeof(struct layout_request));
+	    if (r == NULL) {
+		error(errno, "can't allocate memory for layout");
+		goto fail;
+	    }
+	    l->list = r;
+	}
+	r = &l->list[l->count];
+	memset(r, 0, sizeof(*r));
+	r->extent = -1;
+	full = resolve_type(type);
+	if (strlen(name) > DPISTRLEN || strlen(full) > DPISTRLEN) {
+	    error(-1, "%s:%d: names and types are at most %d characters",
+		    file, number, DPISTRLEN);
+	    goto fail;
+	}
+	if (strncmp(full, kFreeType, DPISTRLEN) == 0
+		|| strncmp(full, kMapType, DPISTRLEN) == 0) {
+	    error(-1, "%s:%d: can't create a partition of type %s",
+		    file, number, full);
+	    goto fail;
+	}
+	strcpy(r->name, name);
+	strcpy(r->type, full);
+
+	if (strcmp(size, "rest") == 0) {
+	    if (l->rest >= 0) {
+		error(-1, "%s:%d: only one partition can have the rest",
+			file, number);
+		goto fail;
+	    }
+	    r->kind = kRest;
+	    l->rest = l->count;
+	} else if (size[strlen(size) - 1] == '%') {
+	    r->kind = kPercent;
+	    r->size = strtol(size, &end, 10);
+	    if (end == size || *end != '%' || r->size <= 0 || r->size > 100) {
+		error(-1, "%s:%d: bad percentage '%s'", file, number, size);
+		goto fail;
+	    }
+	} else {
+	    r->kind = kBlocks;
+	    if (parse_blocks(size, &r->size) == 0 || r->size <= 0) {
+		error(-1, "%s:%d: bad size '%s'", file, number, size);
+		goto fail;
+	    }
+	}
+	if (fields >= 4
+		&& (parse_blocks(align, &r->align) == 0 || r->align <= 0)) {
+	    error(-1, "%s:%d: bad alignment '%s'", file, number, align);
+	    goto fail;
+	}
+	l->count++;
+    }
+    if (f != stdin) {
+	fclose(f);
+    }
+    if (l->count == 0) {
+	error(-1, "layout file '%s' has no partitions", file);
+	free(l->list);
+	return 0;
+    }
+    return 1;
+
+fail:
+    if (f != stdin) {
+	fclose(f);
+    }
+    free(l->list);
+    return 0;
+}
+
+
+//
+// Put r at the first aligned place that fits, in extents other than
+// skip.
+//
+int
+place_first_fit(struct layout_request *r, struct free_extent *e, int count,
+	long skip)
+{
+    uint64_t base;
+    int i;
+
+    for (i = 0; i < count; i++) {
+	base = align_up(e[i].cursor, r->align);
+	if (i != skip && base + r->length <= e[i].end) {
+	    r->extent = i;
+	    r->base = base;
+	    e[i].cursor = base + r->length;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+
+//
+// Give the rest request the largest extent left, less the room the
+// requests after it need there because they fit nowhere else.
+//
+int
+place_rest(struct layout *l, struct free_extent *e, int count, int first)
+{
+    struct layout_request *rest;
+    struct layout_request *r;
+    uint64_t base;
+    uint64_t end;
+    uint64_t room;
+    uint64_t best_room;
+    long best;
+    int i;
+
+    rest = &l->list[l->rest];
+    best = -1;
+    best_room = 0;
+    for (i = 0; i < count; i++) {
+	base = align_up(e[i].cursor, rest->align);
+	room = (base < e[i].end)? e[i].end - base: 0;
+	if (room > best_room) {
+	    best = i;
+	    best_room = room;
+	}
+    }
+    if (best < 0) {
+	error(-1, "no free space left for '%s'", rest->name);
+	return 0;
+    }
+    for (i = first; i < l->count; i++) {
+	place_first_fit(&l->list[i], e, count, best);
+    }
+	// the others are packed back from the end of the extent
+    end = e[best].end;
+    for (i = l->count - 1; i >= first; i--) {
+	r = &l->list[i];
+	if (r->extent >= 0) {
+	    continue;
+	}
+	if (end < e[best].cursor + r->length
+		|| align_down(end - r->length, r->align) < e[best].cursor) {
+	    error(-1, "no free space left for '%s' (%u blocks)", r->name,
+		    r->length);
+	    return 0;
+	}
+	r->extent = best;
+	r->base = align_down(end - r->length, r->align);
+	end = r->base;
+    }
+    base = align_up(e[best].cursor, rest->align);
+    if (base >= end) {
+	error(-1, "no free space left for '%s'", rest->name);
+	return 0;
+    }
+    rest->length = end - base;
+    if (rest->length >= rest->align) {
+	rest->length -= rest->length % rest->align;
+    }
+    rest->extent = best;
+    rest->base = base;
+    e[best].cursor = e[best].end;
+    return 1;
+}
+
+
+int
+plan_layout(struct layout *l, struct free_extent *e, int count)
+{
+    struct layout_request *r;
+    uint64_t total;
+    int i;
+
+    total = 0;
+    for (i = 0; i < count; i++) {
+	total += e[i].end - e[i].start;
+    }
+    for (i = 0; i < l->count; i++) {
+	r = &l->list[i];
+	if (r->kind == kBlocks) {
+	    r->length = r->size;
+	} else if (r->kind == kPercent) {
+	    r->length = total * r->size / 100;
+	    if (r->length >= r->align) {
+		r->length -= r->length % r->align;
+	    }
+	}
+	if (r->kind != kRest && r->length == 0) {
+	    error(-1, "'%s' would have no blocks", r->name);
+	    return 0;
+	}
+    }
+    for (i = 0; i < l->count; i++) {
+	r = &l->list[i];
+	if (r->kind == kRest) {
+	    return place_rest(l, e, count, i + 1);
+	}
+	if (place_first_fit(r, e, count, -1) == 0) {
+	    error(-1, "no free space left for '%s' (%u blocks)", r->name,
+		    r->length);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+
+//
+// How many entries the map gains: in each extent that was used, the
+// partitions and the free pieces around them replace one free entry.
+//
+long
+count_layout_entries(struct layout *l, struct free_extent *e, int count)
+{
+    struct layout_request *r;
+    uint64_t pos;
+    long added;
+    int used;
+    int i;
+    int j;
+
+    added = 0;
+    for (i = 0; i < count; i++) {
+	    // partitions in an extent don't overlap, so walk them by base
+	used = 0;
+	pos = e[i].start;
+	for (;;) {
+	    r = NULL;
+	    for (j = 0; j < l->count; j++) {
+		if (l->list[j].extent == i && l->list[j].base >= pos
+			&& (r == NULL || l->list[j].base < r->base)) {
+		    r = &l->list[j];
+		}
+	    }
+	    if (r == NULL) {
+		break;
+	    }
+	    if (r->base > pos) {
+		added++;
+	    }
+	    added++;
+	    used = 1;
+	    pos = (uint64_t) r->base + r->length;
+	}
+	if (used) {
+	    if (pos < e[i].end) {
+		added++;
+	    }
+	    added--;
+	}
+    }
+    return added;
+}
+
+
+//
+// Plan the partitions of file into the free space of name, and unless
+// read-only, add them and write the map.  Returns 1 on success.
+//
+int
+apply_layout(char *file, char *name)
+{
+    partition_map_header *map;
+    partition_map * entry;
+    struct layout l;
+    struct free_extent *e;
+    struct layout_request *r;
+    long added;
+    long limit;
+    uint32_t map_size;
+    int count;
+    int valid_file;
+    int result;
+    int fd;
+    int i;
+
+    if (read_layout(file, &l) == 0) {
+	return 0;
+    }
+    map = open_partition_map(name, &valid_file);
+    if (map == NULL) {
+	if (!valid_file) {
+	    free(l.list);
+	    return 0;
+	}
+	    // no map: make one with room for a free piece before and
+	    // after every partition
+	fd = open_device(name, (rflag)?O_RDONLY:O_RDWR);
+	if (fd < 0) {
+	    error(errno, "can't open file '%s'", name);
+	    free(l.list);
+	    return 0;
+	}
+	map = make_partition_map_header(name, fd, !rflag);
+	if (map == NULL) {
+	    free(l.list);
+	    return 0;
+	}
+	map_size = (map->media_size <= 128)? 2: 63;
+	if (map_size < 2 * l.count + 2) {
+	    map_size = 2 * l.count + 2;
+	}
+	if (map->misc == NULL || map_size + 1 >= map->media_size
+		|| empty_partition_map(map) == 0
+		|| add_partition_to_map("Apple", kMapType, 1, map_size,
+		    map) == 0) {
+	    error(-1, "can't make a map on '%s'", name);
+	    close_partition_map(map);
+	    free(l.list);
+	    return 0;
+	}
+	printf("No map on %s, making one of %u blocks\n", name, map_size);
+    }
+
+    if (!rflag && !map->writeable) {
+	error(-1, "can't write the map on '%s'", name);
+	close_partition_map(map);
+	free(l.list);
+	return 0;
+    }
+    for (i = 0; i < l.count; i++) {
+	if (l.list[i].align == 0) {
+	    l.list[i].align = map->alignment;
+	}
+    }
+    count = 0;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	count++;
+    }
+    e = (struct free_extent *) malloc(count * sizeof(struct free_extent));
+    if (e == NULL) {
+	error(errno, "can't allocate memory for layout");
+	close_partition_map(map);
+	free(l.list);
+	return 0;
+    }
+    count = 0;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) == 0
+		&& entry->data->dpme_pblock_start < map->media_size) {
+	    e[count].start = entry->data->dpme_pblock_start;
+	    e[count].cursor = e[count].start;
+	    e[count].end = e[count].start + entry->data->dpme_pblocks;
+	    if (e[count].end > map->media_size) {
+		e[count].end = map->media_size;
+	    }
+	    count++;
+	}
+    }
+
+    result = plan_layout(&l, e, count);
+    if (result) {
+	added = count_layout_entries(&l, e, count);
+	limit = (map->maximum_in_map < 0)? map->media_size: map->maximum_in_map;
+	if (map->blocks_in_map + added > limit) {
+	    error(-1, "the layout needs %ld map entries but the map on '%s' "
+		    "has room for %ld; use --grow-map", map->blocks_in_map + added,
+		    name, limit);
+	    result = 0;
+	}
+    }
+    if (result) {
+	for (i = 0; i < l.count; i++) {
+	    r = &l.list[i];
+	    printf("%-*s %*s %10u @ %-10u\n", DPISTRLEN, r->name,
+		    DPISTRLEN / 2, r->type, r->length, r->base);
+	}
+    }
+    if (result && !rflag) {
+	for (i = 0; result && i < l.count; i++) {
+	    r = &l.list[i];
+	    result = add_partition_to_map(r->name, r->type, r->base,
+		    r->length, map);
+	}
+	if (result) {
+	    result = write_partition_map(map);
+	}
+    }
+    free(e);
+    free(l.list);
+    close_partition_map(map);
+    return result;
+}
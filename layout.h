@@ -0,0 +1,29 @@
+//
+// layout.h - place a list of partitions in the free space of a map
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int apply_layout(char *file, char *name);
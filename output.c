@@ -0,0 +1,338 @@
+//
+// output.c - buffered output for listings
+//
+// Listings are formatted into a growable buffer and handed to the
+// kernel with as few write calls as possible.  Anything still sitting
+// in stdio is flushed first so the two never interleave out of order.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "errors.h"
+#include "output.h"
+
+
+//
+// Defines
+//
+#define OUTPUT_CHUNK	(64*1024)
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+int output_format = kTextFormat;
+
+static output_buffer *stdout_buffer;
+
+
+//
+// Forward declarations
+//
+int grow_output(output_buffer *ob, size_t needed);
+
+
+//
+// Routines
+//
+output_buffer *
+new_output_buffer(int fd)
+{
+    output_buffer *ob;
+
+    ob = (output_buffer *) malloc(sizeof(output_buffer));
+    if (ob == NULL) {
+	error(errno, "can't allocate memory for output buffer");
+	return NULL;
+    }
+    ob->fd = fd;
+    ob->len = 0;
+    ob->size = OUTPUT_CHUNK;
+    ob->buf = (char *) malloc(ob->size);
+    if (ob->buf == NULL) {
+	error(errno, "can't allocate memory for output buffer");
+	free(ob);
+	return NULL;
+    }
+    return ob;
+}
+
+
+void
+free_output_buffer(output_buffer *ob)
+{
+    if (ob == NULL) {
+	return;
+    }
+    flush_output(ob);
+    free(ob->buf);
+    free(ob);
+}
+
+
+//
+// The buffer shared by everything that lists to standard output.
+//
+output_buffer *
+standard_output()
+{
+    if (stdout_buffer == NULL) {
+	stdout_buffer = new_output_buffer(1);
+	if (stdout_buffer == NULL) {
+	    fatal(errno, "can't set up standard output");
+	}
+    }
+    return stdout_buffer;
+}
+
+
+int
+flush_output(output_buffer *ob)
+{
+    size_t done;
+    ssize_t t;
+
+    if (ob->len == 0) {
+	return 1;
+    }
+    if (ob->fd == 1) {
+	fflush(stdout);
+    }
+    for (done = 0; done < ob->len; done += t) {
+	t = write(ob->fd, ob->buf + done, ob->len - done);
+	if (t < 0) {
+	    if (errno == EINTR) {
+		t = 0;
+		continue;
+	    }
+	    ob->len = 0;
+	    return 0;
+	}
+    }
+    ob->len = 0;
+    return 1;
+}
+
+
+int
+grow_output(output_buffer *ob, size_t needed)
+{
+    char *p;
+    size_t size;
+
+    if (ob->len + needed <= ob->size) {
+	return 1;
+    }
+    if (ob->len >= OUTPUT_CHUNK) {
+	flush_output(ob);
+	if (needed <= ob->size) {
+	    return 1;
+	}
+    }
+    size = ob->size;
+    while (size < ob->len + needed) {
+	size *= 2;
+    }
+    p = (char *) realloc(ob->buf, size);
+    if (p == NULL) {
+	return 0;
+    }
+    ob->buf = p;
+    ob->size = size;
+    return 1;
+}
+
+
+void
+out_printf(output_buffer *ob, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (grow_output(ob, 256) == 0) {
+	return;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+	return;
+    }
+    if ((size_t) n >= ob->size - ob->len) {
+	if (grow_output(ob, n + 1) == 0) {
+	    return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, ap);
+	va_end(ap);
+    }
+    ob->len += n;
+}
+
+
+void
+out_write(output_buffer *ob, const char *s, size_t len)
+{
+    if (grow_output(ob, len) == 0) {
+	return;
+    }
+    memcpy(ob->buf + ob->len, s, len);
+    ob->len += len;
+}
+
+
+void
+out_puts(output_buffer *ob, const char *s)
+{
+    out_write(ob, s, strlen(s));
+}
+
+
+void
+out_putc(output_buffer *ob, int c)
+{
+    if (grow_output(ob, 1) == 0) {
+	return;
+    }
+    ob->buf[ob->len++] = c;
+}
+
+
+//
+// Emit at most maxlen characters of s as a quoted JSON string.
+// Partition map strings are not always terminated, hence maxlen.
+//
+void
+out_json_string(output_buffer *ob, const char *s, size_t maxlen)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+    unsigned char c;
+
+    if (grow_output(ob, maxlen * 6 + 2) == 0) {
+	return;
+    }
+    ob->buf[ob->len++] = '"';
+    for (i = 0; i < maxlen && s[i] != 0; i++) {
+	c = s[i];
+	if (c == '"' || c == '\\') {
+	    ob->buf[ob->len++] = '\\';
+	    ob->buf[ob->len++] = c;
+	} else if (c < 0x20 || c >= 0x7f) {
+	    // Mac Roman and control characters go out as escapes
+	    ob->buf[ob->len++] = '\\';
+	    ob->buf[ob->len++] = 'u';
+	    ob->buf[ob->len++] = '0';
+	    ob->buf[ob->len++] = '0';
+	    ob->buf[ob->len++] = hex[c >> 4];
+	    ob->buf[ob->len++] = hex[c & 0xf];
+	} else {
+	    ob->buf[ob->len++] = c;
+	}
+    }
+    ob->buf[ob->len++] = '"';
+}
+
+
+//
+// Emit at most maxlen characters of s as a TSV field.  Tabs and
+// line breaks would split the record so they become spaces.
+//
+void
+out_tsv_string(output_buffer *ob, const char *s, size_t maxlen)
+{
+    size_t i;
+    char c;
+
+    if (grow_output(ob, maxlen) == 0) {
+	return;
+    }
+    for (i = 0; i < maxlen && s[i] != 0; i++) {
+	c = s[i];
+	if (c == '\t' || c == '\n' || c == '\r') {
+	    c = ' ';
+	}
+	ob->buf[ob->len++] = c;
+    }
+}
+
+
+//
+// Records are a JSON object per line or a tab separated line whose
+// first column is the record kind.  Fields go out in the order they
+// are added; TSV consumers rely on that order, JSON ones on the keys.
+//
+void
+out_begin_record(output_buffer *ob, const char *kind)
+{
+    if (output_format == kJSONFormat) {
+	out_puts(ob, "{\"record\":\"");
+	out_puts(ob, kind);
+	out_putc(ob, '"');
+    } else {
+	out_puts(ob, kind);
+    }
+}
+
+
+void
+out_number_field(output_buffer *ob, const char *key, unsigned long value)
+{
+    if (output_format == kJSONFormat) {
+	out_printf(ob, ",\"%s\":%lu", key, value);
+    } else {
+	out_printf(ob, "\t%lu", value);
+    }
+}
+
+
+void
+out_text_field(output_buffer *ob, const char *key, const char *s, size_t maxlen)
+{
+    if (output_format == kJSONFormat) {
+	out_printf(ob, ",\"%s\":", key);
+	out_json_string(ob, s, maxlen);
+    } else {
+	out_putc(ob, '\t');
+	out_tsv_string(ob, s, maxlen);
+    }
+}
+
+
+void
+out_end_record(output_buffer *ob)
+{
+    if (output_format == kJSONFormat) {
+	out_putc(ob, '}');
+    }
+    out_putc(ob, '\n');
+}
+
+
+int
+parse_output_format(const char *name)
+{
+    if (strcmp(name, "text") == 0) {
+	return kTextFormat;
+    } else if (strcmp(name, "json") == 0) {
+	return kJSONFormat;
+    } else if (strcmp(name, "tsv") == 0) {
+	return kTSVFormat;
+    }
+    return -1;
+}
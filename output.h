@@ -0,0 +1,64 @@
+//
+// output.h - buffered output for listings
+//
+#ifndef output_h
+#define output_h
+
+#include <stddef.h>
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+enum output_formats {
+    kTextFormat = 0,
+    kJSONFormat = 1,	// one JSON object per line
+    kTSVFormat = 2	// one tab separated record per line
+};
+
+struct output_buffer {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t size;
+};
+typedef struct output_buffer output_buffer;
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+extern int output_format;
+
+
+//
+// Forward declarations
+//
+int flush_output(output_buffer *ob);
+void out_begin_record(output_buffer *ob, const char *kind);
+void out_end_record(output_buffer *ob);
+void free_output_buffer(output_buffer *ob);
+output_buffer* new_output_buffer(int fd);
+void out_json_string(output_buffer *ob, const char *s, size_t maxlen);
+void out_printf(output_buffer *ob, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void out_putc(output_buffer *ob, int c);
+void out_puts(output_buffer *ob, const char *s);
+void out_text_field(output_buffer *ob, const char *key, const char *s, size_t maxlen);
+void out_number_field(output_buffer *ob, const char *key, unsigned long value);
+void out_tsv_string(output_buffer *ob, const char *s, size_t maxlen);
+void out_write(output_buffer *ob, const char *s, size_t len);
+int parse_output_format(const char *name);
+output_buffer* standard_output();
+
+#endif
@@ -30,10 +30,13 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <arpa/inet.h>
 
 #ifdef __linux__
 #include <linux/fs.h> // For IOCTLs
@@ -44,6 +47,16 @@
 #include "convert.h"
 #include "io.h"
 #include "errors.h"
+#include "cache.h"
+#include "discard.h"
+#include "wipe.h"
+
+
+//
+// Defines
+//
+#define DEFAULT_ALIGNMENT	(4*1024*1024 / PBLOCK_SIZE)
+#define MAP_READ_CHUNK		64	/* map blocks read at once */
 
 
 //
@@ -66,16 +79,17 @@ enum add_action {
 //
 // Global Variables
 //
+int verify_flag;
+long align_blocks;
 
 
 //
 // Forward declarations
 //
-int add_data_to_map(struct dpme *data, long index, partition_map_header *map);
 void coerce_block0(partition_map_header *map);
+uint32_t compute_alignment(int fd);
 int contains_driver(partition_map *entry);
 void combine_entry(partition_map *entry);
-long compute_device_size(int fd);
 DPME* create_data(const char *name, const char *dptype, uint32_t base, uint32_t length);
 partition_map_header* create_partition_map(char *name);
 void delete_entry(partition_map *entry);
@@ -90,28 +104,11 @@ void renumber_disk_addresses(partition_map_header *map);
 // Routines
 //
 partition_map_header *
-open_partition_map(char *name, int *valid_file)
+make_partition_map_header(char *name, int fd, int writeable)
 {
-    int fd;
     partition_map_header * map;
-    int writeable;
     struct stat info;
 
-    fd = open_device(name, (rflag)?O_RDONLY:O_RDWR);
-    if (fd < 0) {
-	fd = open_device(name, O_RDONLY);
-	if (fd < 0) {
-	    error(errno, "can't open file '%s'", name);
-	    *valid_file = 0;
-	    return NULL;
-	} else {
-	    writeable = 0;
-	}
-    } else {
-	writeable = 1;
-    }
-    *valid_file = 1;
-
     map = (partition_map_header *) malloc(sizeof(partition_map_header));
     if (map == NULL) {
 	error(errno, "can't allocate memory for open partition map");
@@ -120,13 +117,16 @@ open_partition_map(char *name, int *valid_file)
     }
     map->fd = fd;
     map->name = name;
-    map->writeable = (rflag)?0:writeable;
+    map->writeable = writeable;
     map->changed = 0;
     map->disk_order = NULL;
     map->base_order = NULL;
     map->blocks_in_map = 0;
     map->maximum_in_map = -1;
     map->media_size = compute_device_size(fd);
+    map->alignment = compute_alignment(fd);
+    map->allocated = NULL;
+    map->allocated_count = 0;
 
     if (fstat(fd, &info) < 0) {
 	error(errno, "can't stat file '%s'", name);
@@ -135,17 +135,50 @@ open_partition_map(char *name, int *valid_file)
 	map->regular_file = S_ISREG(info.st_mode);
     }
 
-    map->misc = (Block0 *) malloc(PBLOCK_SIZE);
+    map->misc = (Block0 *) calloc(1, PBLOCK_SIZE);
     if (map->misc == NULL) {
 	error(errno, "can't allocate memory for block zero buffer");
-    } else if (read_block(fd, 0, (char *)map->misc, 0) == 0
-	    || convert_block0(map->misc, 1)) {
-	// if I can't read block 0 I might as well give up
-    } else if (read_partition_map(map) < 0) {
-	// some sort of failure reading the map
+    }
+    return map;
+}
+
+
+partition_map_header *
+open_partition_map(char *name, int *valid_file)
+{
+    int fd;
+    partition_map_header * map;
+    int writeable;
+
+    fd = open_device(name, (rflag)?O_RDONLY:O_RDWR);
+    if (fd < 0) {
+	fd = open_device(name, O_RDONLY);
+	if (fd < 0) {
+	    error(errno, "can't open file '%s'", name);
+	    *valid_file = 0;
+	    return NULL;
+	} else {
+	    writeable = 0;
+	}
+    } else {
+	writeable = 1;
+    }
+    *valid_file = 1;
+
+    map = make_partition_map_header(name, fd, (rflag)?0:writeable);
+    if (map == NULL) {
+	return NULL;
+    }
+
+    if (map->misc == NULL) {
+	// no block zero buffer
+    } else if (lookup_map_cache(map) == 0 && read_partition_map(map) < 0) {
+	// some sort of failure reading block 0 or the map
     } else {
 	// got it!
-	coerce_block0(map);
+	if (discard_flag || wipe_flag) {
+	    snapshot_allocated(map);
+	}
 	return map;
     }
     close_partition_map(map);
@@ -156,121 +189,247 @@ open_partition_map(char *name, int *valid_file)
 void
 close_partition_map(partition_map_header *map)
 {
-    partition_map * entry;
-    partition_map * next;
-
     if (map == NULL) {
 	return;
     }
 
     free(map->misc);
+    free(map->allocated);
+    clear_partition_map(map);
+    close_device(map->fd);
+    free(map);
+}
+
+
+//
+// Drop every entry, leaving an empty map on the same medium.
+//
+void
+clear_partition_map(partition_map_header *map)
+{
+    partition_map * entry;
+    partition_map * next;
 
     for (entry = map->disk_order; entry != NULL; entry = next) {
 	next = entry->next_on_disk;
 	free(entry->data);
+	free(entry->probe);
 	free(entry);
     }
-    close_device(map->fd);
-    free(map);
+    map->disk_order = NULL;
+    map->base_order = NULL;
+    map->blocks_in_map = 0;
+    map->maximum_in_map = -1;
 }
 
 
+//
+// Block zero and the first entry come in with one read, which tells
+// us how long the map is; the rest of the map comes in a chunk at a
+// time, the buffer growing with it.  Reading stops at the first block
+// that isn't an entry of this map, and once the map's own entry is
+// seen the count is trusted no further than its size.  Nothing else
+// on the medium is touched.
+//
 int
 read_partition_map(partition_map_header *map)
 {
+    char *buf;
+    char *p;
     DPME *data;
     uint32_t limit;
-    int index;
+    uint32_t index;
+    uint32_t n;
+    uint32_t i;
+    int result;
 
-    data = (DPME *) malloc(PBLOCK_SIZE);
-    if (data == NULL) {
+    buf = (char *) malloc(2 * PBLOCK_SIZE);
+    if (buf == NULL) {
 	error(errno, "can't allocate memory for disk buffers");
 	return -1;
     }
-
-    if (read_block(map->fd, 1, (char *)data, 0) == 0) {
-	free(data);
+    if (read_blocks(map->fd, 0, buf, 2, 0) == 0) {
+	free(buf);
 	return -1;
-    } else if (convert_dpme(data, 1)
-	    || data->dpme_signature != DPME_SIGNATURE) {
-	free(data);
+    }
+    data = (DPME *) (buf + PBLOCK_SIZE);
+    limit = ntohl(data->dpme_map_entries);
+    if (ntohs(data->dpme_signature) != DPME_SIGNATURE
+	    || limit < 1 || limit >= map->media_size) {
+	free(buf);
 	return -1;
-    } else {
-	limit = data->dpme_map_entries;
-	index = 1;
-	while (1) {
-	    if (add_data_to_map(data, index, map) == 0) {
-		free(data);
-		return -1;
-	    }
-
-	    if (index >= limit) {
-		break;
-	    } else {
-		index++;
-	    }
-
-	    data = (DPME *) malloc(PBLOCK_SIZE);
-	    if (data == NULL) {
+    }
+    for (index = 1; index <= limit; index += n) {
+	if (index == 1) {
+	    n = 1;	// already here
+	} else {
+	    n = (limit + 1 - index < MAP_READ_CHUNK)?
+		    limit + 1 - index: MAP_READ_CHUNK;
+	    p = (char *) realloc(buf, ((size_t) index + n) * PBLOCK_SIZE);
+	    if (p == NULL) {
 		error(errno, "can't allocate memory for disk buffers");
+		free(buf);
 		return -1;
 	    }
-
-	    if (read_block(map->fd, index, (char *)data, 0) == 0) {
-		free(data);
+	    buf = p;
+	    if (read_blocks(map->fd, index,
+		    buf + (size_t) index * PBLOCK_SIZE, n, 0) == 0) {
+		free(buf);
 		return -1;
-	    } else if (convert_dpme(data, 1)
-		    || data->dpme_signature != DPME_SIGNATURE
-		    || data->dpme_map_entries != limit) {
-		free(data);
+	    }
+	}
+	for (i = 0; i < n; i++) {
+	    data = (DPME *) (buf + (size_t) (index + i) * PBLOCK_SIZE);
+	    if (ntohs(data->dpme_signature) != DPME_SIGNATURE
+		    || ntohl(data->dpme_map_entries) != limit
+		    || (strncmp(data->dpme_type, kMapType, DPISTRLEN) == 0
+		    && limit > ntohl(data->dpme_pblocks))) {
+		free(buf);
 		return -1;
 	    }
 	}
     }
+    result = load_partition_map(map, buf, limit + 1);
+    if (result == 0) {
+	store_map_cache(map, buf, limit + 1);
+    }
+    free(buf);
+    return result;
+}
+
+
+//
+// Build the map from an image of block zero followed by the map blocks,
+// as captured by stage_partition_map().  The image is left in disk form.
+//
+int
+load_partition_map(partition_map_header *map, char *blocks, long count)
+{
+    DPME *data;
+    uint32_t limit;
+    long index;
+
+    if (map->misc == NULL || count < 2) {
+	return -1;
+    }
+    memcpy(map->misc, blocks, PBLOCK_SIZE);
+    convert_block0(map->misc, 1);
+
+    limit = 1;
+    for (index = 1; index < count && index <= limit; index++) {
+	data = (DPME *) malloc(PBLOCK_SIZE);
+	if (data == NULL) {
+	    error(errno, "can't allocate memory for disk buffers");
+	    return -1;
+	}
+	memcpy(data, blocks + index * PBLOCK_SIZE, PBLOCK_SIZE);
+	if (convert_dpme(data, 1)
+		|| data->dpme_signature != DPME_SIGNATURE
+		|| (index > 1 && data->dpme_map_entries != limit)) {
+	    free(data);
+	    return -1;
+	}
+	if (index == 1) {
+	    limit = data->dpme_map_entries;
+	}
+	if (add_data_to_map(data, index, map) == 0) {
+	    free(data);
+	    return -1;
+	}
+    }
+    if (index <= limit) {
+	// image is shorter than the map claims
+	return -1;
+    }
+    coerce_block0(map);
     return 0;
 }
 
 
-void
+//
+// Lay out block zero and every map block, in disk form, in one buffer
+// so that the whole map can go to the medium in a single write.
+// If there is room in the map the block after the last entry is read
+// and its signature zapped (see write_partition_map) so it can ride
+// along in the same write.  The buffer is page aligned.
+//
+char *
+stage_partition_map(partition_map_header *map, long *count)
+{
+    partition_map * entry;
+    char *buf;
+    long last;
+
+    last = 0;
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	if (entry->disk_address > last) {
+	    last = entry->disk_address;
+	}
+    }
+    if (posix_memalign((void **)&buf, 4096, (last + 2) * PBLOCK_SIZE) != 0) {
+	error(errno, "can't allocate memory for map image");
+	return NULL;
+    }
+    memset(buf, 0, (last + 2) * PBLOCK_SIZE);
+
+    if (map->misc != NULL) {
+	memcpy(buf, map->misc, PBLOCK_SIZE);
+	convert_block0((Block0 *)buf, 0);
+    }
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	memcpy(buf + entry->disk_address * PBLOCK_SIZE, entry->data, PBLOCK_SIZE);
+	convert_dpme((DPME *)(buf + entry->disk_address * PBLOCK_SIZE), 0);
+    }
+    *count = last + 1;
+
+	// zap the block after the map (if possible) to get around a bug.
+    if (map->maximum_in_map > 0 && last < map->maximum_in_map) {
+	if (read_block(map->fd, last + 1, buf + *count * PBLOCK_SIZE, 1)) {
+	    buf[*count * PBLOCK_SIZE] = 0;
+	    *count += 1;
+	}
+    }
+    return buf;
+}
+
+
+//
+// Returns 1 if the map was written (and with verify_flag read back
+// intact), 0 if it wasn't.
+//
+int
 write_partition_map(partition_map_header *map)
 {
     int fd;
     char *block;
-    partition_map * entry;
+    long count;
     int i;
     int saved_errno;
+    int result;
 
     fd = map->fd;
-    if (map->misc != NULL) {
-	convert_block0(map->misc, 0);
-	write_block(fd, 0, (char *)map->misc);
-	convert_block0(map->misc, 1);
-    } else {
-	block = (char *) calloc(1, PBLOCK_SIZE);
-	if (block != NULL) {
-	    write_block(fd, 0, block);
-	    free(block);
-	}
+    block = stage_partition_map(map, &count);
+    if (block == NULL) {
+	return 0;
     }
-    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
-	convert_dpme(entry->data, 0);
-	write_block(fd, entry->disk_address, (char *)entry->data);
-	convert_dpme(entry->data, 1);
-	i = entry->disk_address;
+    result = write_blocks(fd, 0, block, count);
+    if (result && verify_flag) {
+	result = verify_blocks(fd, map->name, 0, block, count);
     }
-	// zap the block after the map (if possible) to get around a bug.
-    if (map->maximum_in_map > 0 &&  i < map->maximum_in_map) {
-	i += 1;
-	block = (char *) malloc(PBLOCK_SIZE);
-	if (block != NULL) {
-	    if (read_block(fd, i, block, 1)) {
-		block[0] = 0;
-		write_block(fd, i, block);
-	    }
-	    free(block);
+    free(block);
+    if (result) {
+	printf("The partition map has been saved successfully!\n\n");
+	if (wipe_flag && wipe_new_partitions(map) < 0) {
+	    result = 0;
+	}
+	if (discard_flag) {
+	    discard_freed_space(map);
+	} else if (wipe_flag) {
+	    snapshot_allocated(map);
 	}
+    } else {
+	printf("The partition map was NOT saved correctly!\n\n");
     }
-    printf("The partition map has been saved successfully!\n\n");
 
     if (map->regular_file) {
 	close_device(map->fd);
@@ -322,7 +481,7 @@ write_partition_map(partition_map_header *map)
 	fatal(errno, "can't re-open file '%s' for %sing", map->name,
 		(rflag)?"read":"writ");
     }
-
+    return result;
 }
 
 
@@ -343,6 +502,7 @@ add_data_to_map(struct dpme *data, long index, partition_map_header *map)
     entry->disk_address = index;
     entry->the_map = map;
     entry->data = data;
+    entry->probe = NULL;
 
     insert_in_disk_order(entry);
     insert_in_base_order(entry);
@@ -387,9 +547,7 @@ create_partition_map(char *name)
 {
     int fd;
     partition_map_header * map;
-    DPME *data;
     unsigned long number;
-    struct stat info;
 
     fd = open_device(name, (rflag)?O_RDONLY:O_RDWR);
     if (fd < 0) {
@@ -398,22 +556,12 @@ create_partition_map(char *name)
 	return NULL;
     }
 
-    map = (partition_map_header *) malloc(sizeof(partition_map_header));
+    map = make_partition_map_header(name, fd, (rflag)?0:1);
     if (map == NULL) {
-	error(errno, "can't allocate memory for open partition map");
-	close_device(fd);
 	return NULL;
     }
-    map->fd = fd;
-    map->name = name;
-    map->writeable = (rflag)?0:1;
-    map->changed = 0;
-    map->disk_order = NULL;
-    map->base_order = NULL;
-    map->blocks_in_map = 0;
-    map->maximum_in_map = -1;
 
-    number = compute_device_size(fd);
+    number = map->media_size;
     char prompt[64];
     sprintf(prompt, "Device block size [%lu]: ", number);
     get_number_argument(prompt, (long *)&number, number);
@@ -423,52 +571,53 @@ create_partition_map(char *name)
     printf("new size of 'device' is %lu blocks\n", number);
     map->media_size = number;
 
-    if (fstat(fd, &info) < 0) {
-	error(errno, "can't stat file '%s'", name);
-	map->regular_file = 0;
-    } else {
-	map->regular_file = S_ISREG(info.st_mode);
-    }
-
-    map->misc = (Block0 *) malloc(PBLOCK_SIZE);
-    if (map->misc == NULL) {
-	error(errno, "can't allocate memory for block zero buffer");
-    } else {
-	// got it!
-	data = (DPME *) calloc(1, PBLOCK_SIZE);
-	if (data == NULL) {
-	    error(errno, "can't allocate memory for disk buffers");
-	} else {
-	    // set data into entry
-	    data->dpme_signature = DPME_SIGNATURE;
-	    data->dpme_map_entries = 1;
-	    data->dpme_pblock_start = 1;
-	    data->dpme_pblocks = map->media_size - 1;
-	    strncpy(data->dpme_name, kFreeName, DPISTRLEN);
-	    strncpy(data->dpme_type, kFreeType, DPISTRLEN);
-	    data->dpme_lblock_start = 0;
-	    data->dpme_lblocks = data->dpme_pblocks;
-	    dpme_writable_set(data, 1);
-	    dpme_readable_set(data, 1);
-	    dpme_bootable_set(data, 0);
-	    dpme_in_use_set(data, 0);
-	    dpme_allocated_set(data, 0);
-	    dpme_valid_set(data, 1);
-
-	    if (add_data_to_map(data, 1, map) == 0) {
-		free(data);
-	    } else {
-		map->changed = 1;
-		coerce_block0(map);
-		return map;
-	    }
-	}
+    if (map->misc != NULL && empty_partition_map(map) != 0) {
+	return map;
     }
     close_partition_map(map);
     return NULL;
 }
 
 
+//
+// Give a map with no entries a single free entry covering the medium.
+//
+int
+empty_partition_map(partition_map_header *map)
+{
+    DPME *data;
+
+    data = (DPME *) calloc(1, PBLOCK_SIZE);
+    if (data == NULL) {
+	error(errno, "can't allocate memory for disk buffers");
+	return 0;
+    }
+    // set data into entry
+    data->dpme_signature = DPME_SIGNATURE;
+    data->dpme_map_entries = 1;
+    data->dpme_pblock_start = 1;
+    data->dpme_pblocks = map->media_size - 1;
+    strncpy(data->dpme_name, kFreeName, DPISTRLEN);
+    strncpy(data->dpme_type, kFreeType, DPISTRLEN);
+    data->dpme_lblock_start = 0;
+    data->dpme_lblocks = data->dpme_pblocks;
+    dpme_writable_set(data, 1);
+    dpme_readable_set(data, 1);
+    dpme_bootable_set(data, 0);
+    dpme_in_use_set(data, 0);
+    dpme_allocated_set(data, 0);
+    dpme_valid_set(data, 1);
+
+    if (add_data_to_map(data, 1, map) == 0) {
+	free(data);
+	return 0;
+    }
+    map->changed = 1;
+    coerce_block0(map);
+    return 1;
+}
+
+
 void
 coerce_block0(partition_map_header *map)
 {
@@ -564,6 +713,8 @@ add_partition_to_map(const char *name, const char *dptype, uint32_t base, uint32
     if (act == kReplace) {
 	free(cur->data);
 	cur->data = data;
+	free(cur->probe);
+	cur->probe = NULL;
     } else {
 	    // adjust this block's size
 	cur->data->dpme_pblock_start = adjusted_base;
@@ -589,7 +740,10 @@ add_partition_to_map(const char *name, const char *dptype, uint32_t base, uint32
     if (strstr(dptype, "Driver"))
     {
 	// Assume 68k drivers for now
-	strncpy(cur->data->dpme_process_id, "68000", 5);
+	cur = find_entry_by_sector(base, map);
+	if (cur != NULL) {
+	    strncpy(cur->data->dpme_process_id, "68000", 5);
+	}
 
 	Block0* bz = map->misc;
 	if (bz->sbDrvrCount < sizeof(bz->sbMap) / sizeof(DDMap))
@@ -661,6 +815,21 @@ compute_device_size(int fd)
     unsigned long l, r, x;
     int valid;
 
+    struct stat info;
+#ifdef BLKGETSIZE64
+    uint64_t bytes;
+#endif
+
+	// ask rather than probe whenever we can
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+	return info.st_size / PBLOCK_SIZE;
+    }
+#ifdef BLKGETSIZE64
+    if (ioctl(fd, BLKGETSIZE64, &bytes) == 0) {
+	return bytes / PBLOCK_SIZE;
+    }
+#endif
+
     data = (char *) malloc(PBLOCK_SIZE);
     if (data == NULL) {
 	error(errno, "can't allocate memory for try buffer");
@@ -741,6 +910,8 @@ delete_partition_from_map(partition_map *entry)
     }
     free(entry->data);
     entry->data = data;
+    free(entry->probe);
+    entry->probe = NULL;
     combine_entry(entry);
     map = entry->the_map;
     renumber_disk_addresses(map);
@@ -818,6 +989,92 @@ combine_entry(partition_map *entry)
 }
 
 
+//
+// Merge every run of adjacent free entries, not just the neighbours of
+// one, drop empty ones, and number the entries in base order.  With
+// shrink the map is also cut down to the entries it holds.  Returns 1
+// if anything changed.
+//
+int
+compact_partition_map(partition_map_header *map, int shrink)
+{
+    partition_map * cur;
+    partition_map * next;
+    partition_map * prev;
+    long index;
+    long size;
+    int changed;
+
+    changed = 0;
+    cur = map->base_order;
+    while (cur != NULL) {
+	next = cur->next_by_base;
+	if (strncmp(cur->data->dpme_type, kFreeType, DPISTRLEN) != 0) {
+	    cur = next;
+	    continue;
+	}
+	if (cur->data->dpme_pblocks == 0 && map->blocks_in_map > 1) {
+	    delete_entry(cur);
+	    changed = 1;
+	    cur = next;
+	    continue;
+	}
+	while (next != NULL
+		&& strncmp(next->data->dpme_type, kFreeType, DPISTRLEN) == 0
+		&& cur->data->dpme_pblock_start + cur->data->dpme_pblocks
+		    == next->data->dpme_pblock_start) {
+	    cur->data->dpme_pblocks += next->data->dpme_pblocks;
+	    cur->data->dpme_lblocks = cur->data->dpme_pblocks;
+	    delete_entry(next);
+	    changed = 1;
+	    next = cur->next_by_base;
+	}
+	cur = next;
+    }
+
+    if (shrink) {
+	for (cur = map->base_order; cur != NULL; cur = cur->next_by_base) {
+	    if (strncmp(cur->data->dpme_type, kMapType, DPISTRLEN) == 0) {
+		break;
+	    }
+	}
+	    // cutting it down may leave a new free entry after it
+	next = (cur != NULL)? cur->next_by_base: NULL;
+	size = map->blocks_in_map;
+	if (next == NULL
+		|| strncmp(next->data->dpme_type, kFreeType, DPISTRLEN) != 0) {
+	    size++;
+	}
+	if (cur != NULL && size < cur->data->dpme_pblocks) {
+	    resize_map(size, map);
+	    changed = 1;
+	}
+    }
+
+	// disk order follows base order
+    prev = NULL;
+    index = 1;
+    for (cur = map->base_order; cur != NULL; cur = cur->next_by_base) {
+	if (cur->disk_address != index++) {
+	    changed = 1;
+	}
+	cur->prev_on_disk = prev;
+	cur->next_on_disk = NULL;
+	if (prev == NULL) {
+	    map->disk_order = cur;
+	} else {
+	    prev->next_on_disk = cur;
+	}
+	prev = cur;
+    }
+    renumber_disk_addresses(map);
+    if (changed) {
+	map->changed = 1;
+    }
+    return changed;
+}
+
+
 void
 delete_entry(partition_map *entry)
 {
@@ -841,6 +1098,7 @@ delete_entry(partition_map *entry)
     }
 
     free(entry->data);
+    free(entry->probe);
     free(entry);
 }
 
@@ -1013,7 +1271,9 @@ resize_map(long new_size, partition_map_header *map)
 	}
 	entry->data->dpme_type[0] = 0;
 	delete_partition_from_map(entry);
-	add_partition_to_map("Apple", kMapType, 1, new_size, map);
+	if (add_partition_to_map("Apple", kMapType, 1, new_size, map)) {
+	    map->maximum_in_map = new_size;
+	}
 	return;
     }
 
@@ -1034,28 +1294,286 @@ resize_map(long new_size, partition_map_header *map)
     }
     entry->data->dpme_type[0] = 0;
     delete_partition_from_map(entry);
-    add_partition_to_map("Apple", kMapType, 1, new_size, map);
+    if (add_partition_to_map("Apple", kMapType, 1, new_size, map)) {
+	map->maximum_in_map = new_size;
+    }
+}
+
+
+//
+// Give the partition of entry the extent base, length.  The new extent
+// may overlap the old one; the rest of it must be free.  Everything
+// else in the entry, its driver descriptors and, where the map allows,
+// its index stay as they were.  Only the map is changed, not the data.
+// Returns the moved entry, or NULL (with the partition left where it
+// was) if the extent isn't available.
+//
+partition_map *
+relocate_entry(partition_map *entry, uint32_t base, uint32_t length)
+{
+    partition_map_header *map;
+    partition_map *cur;
+    DPME old;
+    Block0 zero;
+    DDMap *m;
+    long index;
+    int moved;
+    int i;
+
+    map = entry->the_map;
+    if (strncmp(entry->data->dpme_type, kMapType, DPISTRLEN) == 0
+	    || strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) == 0) {
+	printf("Can only move a partition that is not the map or free\n");
+	return NULL;
+    }
+    if (length == 0 || (uint64_t) base + length > map->media_size) {
+	printf("requested base and length is not on the medium\n");
+	return NULL;
+    }
+    memcpy(&old, entry->data, sizeof(DPME));
+    memcpy(&zero, map->misc, sizeof(Block0));
+    index = entry->disk_address;
+
+	// free it, then take the new extent out of the free space
+    delete_partition_from_map(entry);
+    moved = add_partition_to_map(old.dpme_name, old.dpme_type,
+	    base, length, map);
+    if (moved == 0) {
+	    // put it back where it was
+	base = old.dpme_pblock_start;
+	length = old.dpme_pblocks;
+	add_partition_to_map(old.dpme_name, old.dpme_type, base, length, map);
+    }
+    cur = find_entry_by_sector(base, map);
+    if (cur == NULL) {
+	return NULL;
+    }
+
+    memcpy(map->misc, &zero, sizeof(Block0));
+    if (zero.sbSig == BLOCK0_SIGNATURE) {
+	m = (DDMap *) map->misc->sbMap;
+	for (i = 0; i < zero.sbDrvrCount
+		&& i < sizeof(zero.sbMap) / sizeof(DDMap); i++) {
+	    if (m[i].ddBlock == old.dpme_pblock_start) {
+		m[i].ddBlock = base;
+	    }
+	}
+    }
+    old.dpme_map_entries = cur->data->dpme_map_entries;
+    old.dpme_pblock_start = base;
+    if (old.dpme_lblocks == old.dpme_pblocks
+	    || old.dpme_lblock_start >= length) {
+	old.dpme_lblock_start = 0;
+	old.dpme_lblocks = length;
+    } else if (old.dpme_lblock_start + old.dpme_lblocks > length) {
+	old.dpme_lblocks = length - old.dpme_lblock_start;
+    }
+    old.dpme_pblocks = length;
+    memcpy(cur->data, &old, sizeof(DPME));
+
+    if (index > map->blocks_in_map) {
+	index = map->blocks_in_map;
+    }
+    if (cur->disk_address != index) {
+	move_entry_in_map(cur->disk_address, index, map);
+    }
+    map->changed = 1;
+    return (moved)? cur: NULL;
+}
+
+//
+// Make the map describe a medium of new_size blocks by moving the end
+// of the trailing free entry (adding or dropping one as needed) and
+// updating block zero to match.  Refuses if an allocated partition
+// would fall off the end.
+//
+int
+set_media_size(uint32_t new_size, partition_map_header *map)
+{
+    partition_map * last;
+    DPME *data;
+    uint32_t end;
+    int limit;
+
+    last = map->base_order;
+    if (last == NULL) {
+	printf("No partition map exists\n");
+	return 0;
+    }
+    while (last->next_by_base != NULL) {
+	last = last->next_by_base;
+    }
+    end = last->data->dpme_pblock_start + last->data->dpme_pblocks;
+
+    if (strncmp(last->data->dpme_type, kFreeType, DPISTRLEN) == 0) {
+	if (new_size < last->data->dpme_pblock_start) {
+	    printf("map needs %u blocks but the medium has only %u\n",
+		    last->data->dpme_pblock_start, new_size);
+	    return 0;
+	} else if (new_size == last->data->dpme_pblock_start) {
+	    delete_entry(last);
+	    renumber_disk_addresses(map);
+	} else {
+	    last->data->dpme_pblocks = new_size - last->data->dpme_pblock_start;
+	    last->data->dpme_lblocks = last->data->dpme_pblocks;
+	}
+    } else if (new_size < end) {
+	printf("map needs %u blocks but the medium has only %u\n",
+		end, new_size);
+	return 0;
+    } else if (new_size > end) {
+	if (map->maximum_in_map < 0) {
+	    limit = map->media_size;
+	} else {
+	    limit = map->maximum_in_map;
+	}
+	if (map->blocks_in_map + 1 > limit) {
+	    printf("the map is not big enough\n");
+	    return 0;
+	}
+	data = create_data(kFreeName, kFreeType, end, new_size - end);
+	if (data == NULL) {
+	    return 0;
+	}
+	if (add_data_to_map(data, map->blocks_in_map + 1, map) == 0) {
+	    free(data);
+	    return 0;
+	}
+	renumber_disk_addresses(map);
+    }
+
+    map->media_size = new_size;
+    if (map->misc != NULL && map->misc->sbSig == BLOCK0_SIGNATURE) {
+	map->misc->sbBlkCount = new_size;
+    }
+    map->changed = 1;
+    return 1;
 }
 
+//
+// The first aligned block of free space, or failing that the first
+// free block.
+//
 uint32_t
 find_free_space(partition_map_header *map)
 {
     partition_map * cur;
     uint32_t result = -1;
+    uint64_t base;
 
     // find a block that starts includes base and length
     cur = map->base_order;
     while (cur != NULL) {
 	if (strncmp(cur->data->dpme_type, kFreeType, DPISTRLEN) == 0) {
-	    result = cur->data->dpme_pblock_start;
-	    break;
-	} else {
-	    cur = cur->next_by_base;
+	    base = align_block(cur->data->dpme_pblock_start, map);
+	    if (base < (uint64_t) cur->data->dpme_pblock_start
+		    + cur->data->dpme_pblocks) {
+		return base;
+	    }
+	    if (result == (uint32_t) -1) {
+		result = cur->data->dpme_pblock_start;
+	    }
 	}
+	cur = cur->next_by_base;
     }
     return result;
 }
 
+
+//
+// New partitions start on multiples of the larger of the optimal I/O
+// size and the discard granularity the kernel reports for the device,
+// so that they don't straddle erase blocks; image files, and devices
+// that report neither, use DEFAULT_ALIGNMENT.  --align overrides both.
+//
+uint32_t
+compute_alignment(int fd)
+{
+    struct stat info;
+    static const char *attr[] = {"optimal_io_size", "discard_granularity"};
+    char path[96];
+    FILE *f;
+    unsigned long value;
+    unsigned long best;
+    int i;
+    int j;
+
+    if (align_blocks > 0) {
+	return align_blocks;
+    }
+    if (fstat(fd, &info) < 0 || !S_ISBLK(info.st_mode)) {
+	return DEFAULT_ALIGNMENT;
+    }
+    best = 0;
+    for (i = 0; i < 2; i++) {
+	    // a partition has no queue of its own, its disk's is one up
+	for (j = 0; j < 2; j++) {
+	    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%squeue/%s",
+		    major(info.st_rdev), minor(info.st_rdev),
+		    (j == 0)? "": "../", attr[i]);
+	    f = fopen(path, "r");
+	    if (f == NULL) {
+		continue;
+	    }
+	    if (fscanf(f, "%lu", &value) == 1 && value > best) {
+		best = value;
+	    }
+	    fclose(f);
+	    break;
+	}
+    }
+    best /= PBLOCK_SIZE;
+    return (best > 0)? best: DEFAULT_ALIGNMENT;
+}
+
+
+//
+// block, rounded up to the alignment of the map.
+//
+uint64_t
+align_block(uint64_t block, partition_map_header *map)
+{
+    return (block + map->alignment - 1) / map->alignment * map->alignment;
+}
+
+//
+// which is an index, or the name of exactly one partition.
+//
+partition_map*
+find_partition(partition_map_header *map, const char *which)
+{
+    partition_map * entry;
+    partition_map * found;
+    const char *p;
+
+    for (p = which; isdigit((unsigned char) *p); p++) {
+    }
+    if (p != which && *p == 0) {
+	entry = find_entry_by_disk_address(atol(which), map);
+	if (entry == NULL) {
+	    error(-1, "no partition %s on '%s'", which, map->name);
+	}
+	return entry;
+    }
+    found = NULL;
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	if (strncmp(entry->data->dpme_name, which, DPISTRLEN) != 0) {
+	    continue;
+	}
+	if (found != NULL) {
+	    error(-1, "more than one partition is named '%s' on '%s', "
+		    "give its index", which, map->name);
+	    return NULL;
+	}
+	found = entry;
+    }
+    if (found == NULL) {
+	error(-1, "no partition named '%s' on '%s'", which, map->name);
+    }
+    return found;
+}
+
+
 partition_map*
 find_entry_by_sector(uint32_t lba, partition_map_header *map)
 {
@@ -41,6 +41,9 @@ struct partition_map_header {
     int blocks_in_map;
     int maximum_in_map;
     uint32_t media_size;
+    uint32_t alignment;		// blocks new partitions start on
+    struct extent *allocated;	// as opened, for discard and wipe
+    long allocated_count;
 };
 typedef struct partition_map_header partition_map_header;
 
@@ -52,6 +55,7 @@ struct partition_map {
     long disk_address;
     struct partition_map_header * the_map;
     DPME *data;
+    struct fs_probe *probe;	// what probe_partitions() found, or NULL
 };
 typedef struct partition_map partition_map;
 
@@ -68,19 +72,38 @@ extern const char * kBootstrapName;
 extern const char * kFreeName;
 
 
+//
+// Global Variables
+//
+extern int verify_flag;
+extern long align_blocks;
+
+
 //
 // Forward declarations
 //
+int add_data_to_map(struct dpme *data, long index, partition_map_header *map);
+uint64_t align_block(uint64_t block, partition_map_header *map);
 int add_partition_to_map(const char *name, const char *dptype, uint32_t base, uint32_t length, partition_map_header *map);
+void clear_partition_map(partition_map_header *map);
 void close_partition_map(partition_map_header *map);
+long compute_device_size(int fd);
+int compact_partition_map(partition_map_header *map, int shrink);
 void delete_partition_from_map(partition_map *entry);
+int empty_partition_map(partition_map_header *map);
 partition_map* find_entry_by_disk_address(long index, partition_map_header *map);
 partition_map* find_entry_by_sector(uint32_t lba, partition_map_header *map);
+partition_map* find_partition(partition_map_header *map, const char *which);
 partition_map_header* init_partition_map(char *name, partition_map_header* oldmap);
+int load_partition_map(partition_map_header *map, char *blocks, long count);
+partition_map_header* make_partition_map_header(char *name, int fd, int writeable);
 void move_entry_in_map(long old_index, long index, partition_map_header *map);
 partition_map_header* open_partition_map(char *name, int *valid_file);
+partition_map* relocate_entry(partition_map *entry, uint32_t base, uint32_t length);
 void resize_map(long new_size, partition_map_header *map);
-void write_partition_map(partition_map_header *map);
+int set_media_size(uint32_t new_size, partition_map_header *map);
+char* stage_partition_map(partition_map_header *map, long *count);
+int write_partition_map(partition_map_header *map);
 uint32_t find_free_space(partition_map_header *map);
 
 #endif
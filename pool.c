@@ -0,0 +1,230 @@
+//
+// pool.c - work stealing thread pool
+//
+// The tasks of a job are numbered 0 to count-1.  Each worker starts
+// with an equal slice of the numbers and takes work from the front of
+// its own slice.  A worker that runs dry steals the back half of the
+// fullest remaining slice, so a few slow tasks (a huge image, a stalled
+// device) don't leave the other workers idle.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "errors.h"
+#include "pool.h"
+
+
+//
+// Defines
+//
+#define MAX_WORKERS	256
+
+
+//
+// Types
+//
+struct pool_slice {
+    pthread_mutex_t lock;
+    long next;
+    long end;
+};
+
+struct pool_worker {
+    struct pool *pool;
+    int number;
+};
+
+struct pool {
+    struct pool_slice *slices;
+    int workers;
+    pool_task task;
+    void *arg;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int steal_work(struct pool *pool, int thief);
+void* pool_worker_main(void *arg);
+
+
+//
+// Routines
+//
+int
+default_pool_size()
+{
+    long n;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+	n = 1;
+    } else if (n > MAX_WORKERS) {
+	n = MAX_WORKERS;
+    }
+    return n;
+}
+
+
+//
+// Move the back half of the fullest slice to the thief's (empty) slice.
+//
+int
+steal_work(struct pool *pool, int thief)
+{
+    struct pool_slice *victim;
+    struct pool_slice *mine;
+    long best;
+    long left;
+    long half;
+    long start;
+    int i;
+    int v;
+
+    mine = &pool->slices[thief];
+    for (;;) {
+	best = 0;
+	v = -1;
+	for (i = 0; i < pool->workers; i++) {
+	    if (i == thief) {
+		continue;
+	    }
+	    // racy peek, rechecked under the lock below
+	    left = pool->slices[i].end - pool->slices[i].next;
+	    if (left > best) {
+		best = left;
+		v = i;
+	    }
+	}
+	if (v < 0) {
+	    return 0;
+	}
+	victim = &pool->slices[v];
+	pthread_mutex_lock(&victim->lock);
+	left = victim->end - victim->next;
+	if (left <= 0) {
+	    pthread_mutex_unlock(&victim->lock);
+	    continue;
+	}
+	half = (left + 1) / 2;
+	victim->end -= half;
+	start = victim->end;
+	pthread_mutex_unlock(&victim->lock);
+
+	// never hold two slice locks at once
+	pthread_mutex_lock(&mine->lock);
+	mine->next = start;
+	mine->end = start + half;
+	pthread_mutex_unlock(&mine->lock);
+	return 1;
+    }
+}
+
+
+void *
+pool_worker_main(void *arg)
+{
+    struct pool_worker *w = (struct pool_worker *) arg;
+    struct pool *pool = w->pool;
+    struct pool_slice *mine = &pool->slices[w->number];
+    long task;
+
+    for (;;) {
+	pthread_mutex_lock(&mine->lock);
+	if (mine->next < mine->end) {
+	    task = mine->next++;
+	} else {
+	    task = -1;
+	}
+	pthread_mutex_unlock(&mine->lock);
+
+	if (task >= 0) {
+	    pool->task(task, w->number, pool->arg);
+	} else if (steal_work(pool, w->number) == 0) {
+	    break;
+	}
+    }
+    return NULL;
+}
+
+
+//
+// Run task(n, worker, arg) for every n in [0, count) on up to workers
+// threads and wait for all of them to finish.  worker is the number of
+// the calling thread (0 to workers-1) so tasks can keep per thread
+// state.  Returns the number of threads actually used.
+//
+int
+run_pool(long count, int workers, pool_task task, void *arg)
+{
+    struct pool pool;
+    struct pool_worker *w;
+    pthread_t *threads;
+    int started;
+    int i;
+
+    if (workers < 1) {
+	workers = 1;
+    } else if (workers > MAX_WORKERS) {
+	workers = MAX_WORKERS;
+    }
+    if (count < workers) {
+	workers = (count > 0)? count: 1;
+    }
+
+    pool.workers = workers;
+    pool.task = task;
+    pool.arg = arg;
+    pool.slices = (struct pool_slice *) calloc(workers, sizeof(struct pool_slice));
+    w = (struct pool_worker *) calloc(workers, sizeof(struct pool_worker));
+    threads = (pthread_t *) calloc(workers, sizeof(pthread_t));
+    if (pool.slices == NULL || w == NULL || threads == NULL) {
+	error(errno, "can't allocate memory for thread pool");
+	free(pool.slices);
+	free(w);
+	free(threads);
+	return 0;
+    }
+    for (i = 0; i < workers; i++) {
+	pthread_mutex_init(&pool.slices[i].lock, NULL);
+	pool.slices[i].next = count * i / workers;
+	pool.slices[i].end = count * (i + 1) / workers;
+	w[i].pool = &pool;
+	w[i].number = i;
+    }
+
+	// worker 0 is this thread
+    for (started = 1; started < workers; started++) {
+	if (pthread_create(&threads[started], NULL, pool_worker_main,
+		&w[started]) != 0) {
+	    break;
+	}
+    }
+    pool_worker_main(&w[0]);
+    for (i = 1; i < started; i++) {
+	pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < workers; i++) {
+	pthread_mutex_destroy(&pool.slices[i].lock);
+    }
+    free(pool.slices);
+    free(w);
+    free(threads);
+    return started;
+}
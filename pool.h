@@ -0,0 +1,35 @@
+//
+// pool.h - work stealing thread pool
+//
+#ifndef pool_h
+#define pool_h
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+typedef void (*pool_task)(long task, int worker, void *arg);
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int default_pool_size();
+int run_pool(long count, int workers, pool_task task, void *arg);
+
+#endif
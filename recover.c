@@ -0,0 +1,383 @@
+//
+// recover.c - rebuild a lost partition map from what is on the medium
+//
+// The whole medium is read front to back in large aligned chunks and
+// every 512 byte block is checked for the few signatures we know: map
+// entries left over from the old map, and the superblocks of HFS,
+// HFS Plus, ext2 and ProDOS volumes.  Each signature sits at a fixed
+// offset in the block, so the check is a handful of loads per block
+// and the scan runs as fast as the medium can be read.
+//
+// The volumes found are laid out into a fresh map, which is shown and
+// only written if the user agrees.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "convert.h"
+#include "dump.h"
+#include "discard.h"
+#include "recover.h"
+
+
+//
+// Defines
+//
+#define RECOVER_CHUNK	8192		/* blocks per read (4MB) */
+#define RECOVER_MAP	63		/* map blocks assumed without an entry */
+
+#define be16(p)		(((p)[0] << 8) | (p)[1])
+#define be32(p)		(((uint32_t) be16(p) << 16) | be16((p) + 2))
+#define le16(p)		(((p)[1] << 8) | (p)[0])
+#define le32(p)		(((uint32_t) le16((p) + 2) << 16) | le16(p))
+
+
+//
+// Types
+//
+enum recover_source {
+    kFromMap = 0,	// a surviving map entry; sorts first
+    kFromVolume = 1
+};
+
+struct found_volume {
+    uint32_t start;
+    uint32_t length;
+    int source;
+    char type[DPISTRLEN+1];
+    char name[DPISTRLEN+1];
+};
+
+struct found_list {
+    struct found_volume *list;
+    long count;
+    long size;
+    uint32_t map_size;		// from a surviving map entry, or 0
+    uint32_t map_run;		// block after the map entries from block 1
+};
+
+
+//
+// Global Constants
+//
+const char * kHFSType = "Apple_HFS";
+const char * kProDOSType = "Apple_PRODOS";
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int add_found(struct found_list *found, uint32_t start, uint64_t length,
+	int source, const char *type, const char *name, int namelen);
+int compare_found(const void *a, const void *b);
+void probe_block(struct found_list *found, unsigned char *p, uint32_t block,
+	uint32_t media_size);
+partition_map_header* propose_map(char *name, int fd, int writeable,
+	struct found_list *found);
+int scan_medium(int fd, uint32_t media_size, struct found_list *found);
+
+
+//
+// Routines
+//
+int
+add_found(struct found_list *found, uint32_t start, uint64_t length,
+	int source, const char *type, const char *name, int namelen)
+{
+    struct found_volume *p;
+    struct found_volume *v;
+
+    if (length == 0) {
+	return 0;
+    }
+    if (found->count >= found->size) {
+	found->size = (found->size == 0)? 64: found->size * 2;
+	p = (struct found_volume *) realloc(found->list,
+		found->size * sizeof(struct found_volume));
+	if (p == NULL) {
+	    error(errno, "can't allocate memory for recovered volumes");
+	    return 0;
+	}
+	found->list = p;
+    }
+    v = &found->list[found->count++];
+    v->start = start;
+    v->length = (length > 0xFFFFFFFF)? 0xFFFFFFFF: length;
+    v->source = source;
+    strncpy(v->type, type, DPISTRLEN);
+    v->type[DPISTRLEN] = 0;
+    if (namelen > DPISTRLEN) {
+	namelen = DPISTRLEN;
+    }
+    memcpy(v->name, name, namelen);
+    v->name[namelen] = 0;
+    return 1;
+}
+
+
+int
+compare_found(const void *a, const void *b)
+{
+    const struct found_volume *x = (const struct found_volume *) a;
+    const struct found_volume *y = (const struct found_volume *) b;
+
+    if (x->start != y->start) {
+	return (x->start < y->start)? -1: 1;
+    }
+    return x->source - y->source;
+}
+
+
+//
+// Volumes are found by the superblock in their third block, so the
+// volume starts two blocks before the block that matched.  Map entries
+// are only taken from the map at the front of the medium: the run of
+// them from block 1, and the blocks the map's own entry (or the usual
+// map size) covers.  Stale entries elsewhere, inside old images or
+// files, would otherwise win over the volumes really there.
+//
+void
+probe_block(struct found_list *found, unsigned char *p, uint32_t block,
+	uint32_t media_size)
+{
+    DPME data;
+    uint32_t size;
+    uint32_t count;
+    int n;
+
+    if (p[0] == 'P' && p[1] == 'M') {
+	if (block == found->map_run) {
+	    found->map_run++;
+	} else if (block == 0 || block > ((found->map_size != 0)?
+		found->map_size: RECOVER_MAP)) {
+	    return;
+	}
+	memcpy(&data, p, PBLOCK_SIZE);
+	convert_dpme(&data, 1);
+	if (strncmp(data.dpme_type, kMapType, DPISTRLEN) == 0) {
+	    if (data.dpme_pblock_start == 1 && data.dpme_pblocks < media_size) {
+		found->map_size = data.dpme_pblocks;
+	    }
+	} else if (strncmp(data.dpme_type, kFreeType, DPISTRLEN) != 0
+		&& data.dpme_pblock_start > 1
+		&& data.dpme_pblock_start < media_size) {
+	    add_found(found, data.dpme_pblock_start, data.dpme_pblocks,
+		    kFromMap, data.dpme_type, data.dpme_name,
+		    strnlen(data.dpme_name, DPISTRLEN));
+	}
+	return;
+    }
+    if (block < 2) {
+	return;
+    }
+
+    if (p[0] == 'B' && p[1] == 'D') {
+	// HFS master directory block
+	size = be32(p + 20);		// drAlBlkSiz
+	count = be16(p + 18);		// drNmAlBlks
+	n = p[36];			// drVN
+	if (size != 0 && size % PBLOCK_SIZE == 0 && count != 0 && n <= 27) {
+	    add_found(found, block - 2, be16(p + 28)	// drAlBlSt
+		    + (uint64_t) count * (size / PBLOCK_SIZE) + 2,
+		    kFromVolume, kHFSType, (char *) p + 37, n);
+	}
+    } else if ((p[0] == 'H' && p[1] == '+' && be16(p + 2) == 4)
+	    || (p[0] == 'H' && p[1] == 'X' && be16(p + 2) == 5)) {
+	// HFS Plus volume header
+	size = be32(p + 40);		// blockSize
+	count = be32(p + 44);		// totalBlocks
+	if (size >= PBLOCK_SIZE && (size & (size - 1)) == 0 && count != 0) {
+	    add_found(found, block - 2,
+		    (uint64_t) count * (size / PBLOCK_SIZE),
+		    kFromVolume, kHFSType, "untitled", 8);
+	}
+    } else if (le16(p + 56) == 0xEF53 && le16(p + 90) == 0) {
+	// ext2 superblock, and not a backup copy
+	n = le32(p + 24);		// s_log_block_size
+	count = le32(p + 4);		// s_blocks_count
+	if (n <= 6 && count != 0) {
+	    add_found(found, block - 2,
+		    (uint64_t) count * ((1024 << n) / PBLOCK_SIZE),
+		    kFromVolume, kUnixType, (char *) p + 120,
+		    strnlen((char *) p + 120, 16));
+	}
+    } else if (p[0] == 0 && p[1] == 0 && (p[4] >> 4) == 0xF
+	    && (p[4] & 0xF) != 0 && p[0x23] == 0x27 && p[0x24] == 0x0D) {
+	// ProDOS volume directory key block
+	add_found(found, block - 2, le16(p + 0x29),
+		kFromVolume, kProDOSType, (char *) p + 5, p[4] & 0xF);
+    }
+}
+
+
+//
+// Read the whole medium once.  A chunk that can't be read is read
+// again a block at a time, and only the blocks that still fail are
+// skipped, with a warning; that is the state of the media we are
+// called for.
+//
+int
+scan_medium(int fd, uint32_t media_size, struct found_list *found)
+{
+    unsigned char *buf;
+    uint32_t block;
+    uint32_t count;
+    uint32_t bad;
+    uint32_t i;
+
+    if (posix_memalign((void **)&buf, 4096, RECOVER_CHUNK * PBLOCK_SIZE) != 0) {
+	error(errno, "can't allocate memory for disk buffers");
+	return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (block = 0; block < media_size; block += count) {
+	count = media_size - block;
+	if (count > RECOVER_CHUNK) {
+	    count = RECOVER_CHUNK;
+	}
+	if (read_blocks(fd, block, (char *) buf, count, 1) == 0) {
+	    bad = 0;
+	    for (i = 0; i < count; i++) {
+		if (read_blocks(fd, block + i, (char *) buf, 1, 1) == 0) {
+		    bad++;
+		    continue;
+		}
+		probe_block(found, buf, block + i, media_size);
+	    }
+	    error(-1, "can't read %u of blocks %u to %u, skipped",
+		    bad, block, block + count - 1);
+	    continue;
+	}
+	for (i = 0; i < count; i++) {
+	    probe_block(found, buf + i * PBLOCK_SIZE, block + i, media_size);
+	}
+    }
+    free(buf);
+    return 1;
+}
+
+
+//
+// Lay the volumes found into a new map.  Where two claim the same
+// blocks the one starting first wins, and a surviving map entry beats
+// a volume found at the same place.
+//
+partition_map_header *
+propose_map(char *name, int fd, int writeable, struct found_list *found)
+{
+    partition_map_header *map;
+    struct found_volume *v;
+    uint32_t map_size;
+    uint64_t end;
+    uint64_t used;
+    long i;
+
+    map = make_partition_map_header(name, fd, writeable);
+    if (map == NULL) {
+	return NULL;
+    }
+    if (map->misc == NULL || empty_partition_map(map) == 0) {
+	close_partition_map(map);
+	return NULL;
+    }
+    qsort(found->list, found->count, sizeof(struct found_volume),
+	    compare_found);
+
+    map_size = found->map_size;
+    if (map_size == 0) {
+	map_size = (map->media_size <= 128)? 2: 63;
+    }
+    for (i = 0; i < found->count; i++) {
+	if (found->list[i].start > 1) {
+	    if (found->list[i].start - 1 < map_size) {
+		map_size = found->list[i].start - 1;
+	    }
+	    break;
+	}
+    }
+    add_partition_to_map("Apple", kMapType, 1, map_size, map);
+
+    used = 1 + map_size;
+    for (i = 0; i < found->count; i++) {
+	v = &found->list[i];
+	if (v->start < used) {
+	    continue;
+	}
+	end = (uint64_t) v->start + v->length;
+	if (end > map->media_size) {
+	    printf("%s '%s' at %u runs past the end of the medium, truncated\n",
+		    v->type, v->name, v->start);
+	    end = map->media_size;
+	}
+	if (add_partition_to_map((v->name[0] != 0)? v->name: "untitled",
+		v->type, v->start, end - v->start, map) != 0) {
+	    used = end;
+	}
+    }
+    return map;
+}
+
+
+//
+// Scan name for volumes, propose a map for them and write it if the
+// user agrees.  Returns 0 if nothing could be scanned or the write
+// failed.
+//
+int
+recover_partition_map(char *name)
+{
+    partition_map_header *map;
+    struct found_list found;
+    int writeable;
+    int result;
+    int fd;
+
+    fd = open_device(name, (rflag)?O_RDONLY:O_RDWR);
+    if (fd < 0) {
+	error(errno, "can't open file '%s' for %sing", name,
+		(rflag)?"read":"writ");
+	return 0;
+    }
+    writeable = !rflag;
+
+    memset(&found, 0, sizeof(found));
+    found.map_run = 1;
+    if (scan_medium(fd, compute_device_size(fd), &found) == 0) {
+	close_device(fd);
+	return 0;
+    }
+    map = propose_map(name, fd, writeable, &found);
+    free(found.list);
+    if (map == NULL) {
+	return 0;
+    }
+	// the volumes found are already there, not new partitions
+    snapshot_allocated(map);
+    result = 1;
+
+    printf("Proposed partition map:\n");
+    dump_partition_map(map, 1);
+    if (map->blocks_in_map <= 2) {
+	printf("No volumes found on '%s'.\n", name);
+    } else if (!writeable) {
+	printf("The map is not writeable.\n");
+    } else if (get_okay("Write recovered partition map? [N/y]: ") == 1) {
+	result = write_partition_map(map);
+    }
+    close_partition_map(map);
+    return result;
+}
@@ -0,0 +1,29 @@
+//
+// recover.h - rebuild a lost partition map from what is on the medium
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int recover_partition_map(char *name);
@@ -0,0 +1,923 @@
+//
+// relocate.c - move and resize partitions along with their contents
+//
+// The contents are copied in large chunks, front to back when moving
+// towards the start of the medium and back to front when moving
+// towards the end, so that a chunk is always read before anything is
+// written over it.  Image files are copied with copy_file_range(),
+// which lets the file system share or copy the extents without them
+// passing through us; devices go through a buffer.
+//
+// Progress is recorded in a checkpoint file.  A chunk may be copied
+// again after an interruption as long as its source has not been
+// written over, so the copy is synced and the checkpoint rewritten
+// before the unrecorded part could reach the source of the chunks it
+// covers.  When the partition moves by less than its length each
+// chunk would overwrite its own source, so instead the chunk is saved
+// in the checkpoint file before it is written, and an interrupted
+// chunk is finished from there.  The map is only written once the copy
+// is complete, so an interrupted move is resumed by running the same
+// command again.
+//
+
+#define _GNU_SOURCE	// for copy_file_range
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "relocate.h"
+
+
+//
+// Defines
+//
+#define RELOCATE_CHUNK	16384		/* blocks per copy (8MB) */
+#define CHECKPOINT_SPAN	262144		/* most blocks between checkpoints */
+
+
+//
+// Types
+//
+struct relocation {
+    partition_map *entry;
+    long index;
+    uint32_t from;
+    uint32_t to;
+    uint32_t count;
+};
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+char *checkpoint_file;
+
+
+//
+// Forward declarations
+//
+char* checkpoint_path(char *name);
+int compare_relocations(const void *a, const void *b);
+uint32_t choose_base(partition_map *entry, uint32_t length);
+int copy_range(int fd, int regular_file, uint32_t from, uint32_t to,
+	uint32_t count, char *buf);
+int read_checkpoint(const char *path, uint32_t from, uint32_t to,
+	uint32_t count, uint32_t *done, char *saved, uint32_t *saved_count);
+int write_checkpoint(const char *path, uint32_t from, uint32_t to,
+	uint32_t count, uint32_t done, char *saved, uint32_t saved_count);
+
+
+//
+// Routines
+//
+
+//
+// Parse a number of blocks, which may have a k, m or g suffix as sizes
+// do in the editor.
+//
+int
+parse_blocks(const char *arg, long *value)
+{
+    char *end;
+    long multiple;
+
+    *value = strtol(arg, &end, 10);
+    if (end == arg || *value < 0) {
+	return 0;
+    }
+    switch (*end) {
+    case 'g':
+    case 'G':
+	multiple = 1024*1024*1024 / PBLOCK_SIZE;
+	end++;
+	break;
+    case 'm':
+    case 'M':
+	multiple = 1024*1024 / PBLOCK_SIZE;
+	end++;
+	break;
+    case 'k':
+    case 'K':
+	multiple = 1024 / PBLOCK_SIZE;
+	end++;
+	break;
+    default:
+	multiple = 1;
+	break;
+    }
+    *value *= multiple;
+    return *end == 0;
+}
+
+
+//
+// Parse "index:blocks".
+//
+int
+parse_relocation(const char *arg, long *index, long *value)
+{
+    char *end;
+
+    *index = strtol(arg, &end, 10);
+    if (end == arg || *end != ':' || *index <= 0) {
+	return 0;
+    }
+    return parse_blocks(end + 1, value);
+}
+
+
+//
+// Returns 1 and sets done if path records this copy, 0 if there is no
+// checkpoint, and -1 if it records some other copy or can't be read.
+// If saved isn't NULL the chunk saved with the checkpoint, if any, is
+// read into it (RELOCATE_CHUNK blocks at most) and its length stored
+// in saved_count.
+//
+int
+read_checkpoint(const char *path, uint32_t from, uint32_t to,
+	uint32_t count, uint32_t *done, char *saved, uint32_t *saved_count)
+{
+    FILE *f;
+    char line[80];
+    unsigned int v[5];
+    int n;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+	if (errno == ENOENT) {
+	    return 0;
+	}
+	return -1;
+    }
+    v[4] = 0;
+    if (fgets(line, sizeof(line), f) == NULL) {
+	n = 0;
+    } else {
+	n = sscanf(line, "hfdisk move %u %u %u %u %u", &v[0], &v[1], &v[2],
+		&v[3], &v[4]);
+    }
+    if (n < 4 || v[0] != from || v[1] != to || v[2] != count
+	    || v[3] > count || v[4] > count - v[3] || v[4] > RELOCATE_CHUNK
+	    || (saved != NULL && v[4] > 0 && fread(saved, PBLOCK_SIZE, v[4], f)
+		!= v[4])) {
+	fclose(f);
+	return -1;
+    }
+    fclose(f);
+    *done = v[3];
+    if (saved_count != NULL) {
+	*saved_count = v[4];
+    }
+    return 1;
+}
+
+
+//
+// Replace the checkpoint in one rename so a crash leaves either the
+// old one or the new one.  saved_count blocks of saved go with it.
+//
+int
+write_checkpoint(const char *path, uint32_t from, uint32_t to,
+	uint32_t count, uint32_t done, char *saved, uint32_t saved_count)
+{
+    char *temp;
+    FILE *f;
+    int result;
+
+    temp = (char *) malloc(strlen(path) + 5);
+    if (temp == NULL) {
+	error(errno, "can't allocate memory for file name");
+	return 0;
+    }
+    sprintf(temp, "%s.new", path);
+    result = 0;
+    f = fopen(temp, "w");
+    if (f == NULL) {
+	error(errno, "can't create checkpoint file '%s'", temp);
+    } else {
+	fprintf(f, "hfdisk move %u %u %u %u %u\n", from, to, count, done,
+		saved_count);
+	if ((saved_count > 0
+		&& fwrite(saved, PBLOCK_SIZE, saved_count, f) != saved_count)
+		|| fflush(f) != 0 || fsync(fileno(f)) < 0) {
+	    error(errno, "can't write checkpoint file '%s'", temp);
+	    fclose(f);
+	} else if (fclose(f) != 0 || rename(temp, path) < 0) {
+	    error(errno, "can't replace checkpoint file '%s'", path);
+	} else {
+	    result = 1;
+	}
+    }
+    free(temp);
+    return result;
+}
+
+
+//
+// --checkpoint, or by default NAME.move in the current directory.
+// Free the result if it isn't checkpoint_file.
+//
+char *
+checkpoint_path(char *name)
+{
+    char *path;
+    char *p;
+
+    if (checkpoint_file != NULL) {
+	return checkpoint_file;
+    }
+    p = strrchr(name, '/');
+    p = (p == NULL)? name: p + 1;
+    path = (char *) malloc(strlen(p) + 6);
+    if (path == NULL) {
+	error(errno, "can't allocate memory for file name");
+	return NULL;
+    }
+    sprintf(path, "%s.move", p);
+    return path;
+}
+
+
+//
+// Copy count blocks whose source and destination don't overlap.
+//
+int
+copy_range(int fd, int regular_file, uint32_t from, uint32_t to,
+	uint32_t count, char *buf)
+{
+    loff_t in;
+    loff_t out;
+    size_t len;
+    ssize_t t;
+
+    if (regular_file) {
+	in = (loff_t) from * PBLOCK_SIZE;
+	out = (loff_t) to * PBLOCK_SIZE;
+	len = (size_t) count * PBLOCK_SIZE;
+	while (len > 0) {
+	    t = copy_file_range(fd, &in, fd, &out, len, 0);
+	    if (t < 0 && errno == EINTR) {
+		continue;
+	    }
+	    if (t <= 0) {
+		break;
+	    }
+	    len -= t;
+	}
+	if (len == 0) {
+	    return 1;
+	}
+	// not supported here; the ranges don't overlap, so the whole
+	// chunk can simply be copied again by hand
+    }
+    if (read_blocks(fd, from, buf, count, 0) == 0
+	    || write_blocks(fd, to, buf, count) == 0) {
+	return 0;
+    }
+    return 1;
+}
+
+
+//
+// Copy count blocks from from to to on fd, resuming from the
+// checkpoint file if it records this copy.  The checkpoint is left
+// saying the copy is complete; remove it once the map is written.
+//
+int
+copy_blocks(int fd, int regular_file, uint32_t from, uint32_t to,
+	uint32_t count, const char *checkpoint)
+{
+    char *buf;
+    uint32_t distance;
+    uint32_t done;
+    uint32_t since;
+    uint32_t offset;
+    uint32_t n;
+    int backwards;
+    int overlap;
+
+    if (from == to || count == 0) {
+	return 1;
+    }
+    if (posix_memalign((void **)&buf, 4096,
+	    (size_t) RELOCATE_CHUNK * PBLOCK_SIZE) != 0) {
+	error(errno, "can't allocate memory for copy buffer");
+	return 0;
+    }
+    backwards = (to > from);
+    distance = (backwards)? to - from: from - to;
+	// a chunk that would reach its own source is saved first
+    overlap = (distance < count);
+
+    switch (read_checkpoint(checkpoint, from, to, count, &done, buf, &n)) {
+    case 1:
+	if (done < count) {
+	    printf("Resuming the copy with %u of %u blocks done\n",
+		    done, count);
+	}
+	if (n > 0) {
+		// finish the chunk that was being written from its copy
+	    offset = (backwards)? count - done - n: done;
+	    if (write_blocks(fd, to + offset, buf, n) == 0
+		    || fdatasync(fd) < 0) {
+		error(errno, "can't copy blocks %u to %u", from + offset,
+			to + offset);
+		free(buf);
+		return 0;
+	    }
+	    done += n;
+	}
+	break;
+    case 0:
+	done = 0;
+	break;
+    default:
+	error(-1, "checkpoint file '%s' is for another move; "
+		"finish that one or remove the file", checkpoint);
+	free(buf);
+	return 0;
+    }
+
+    if (done == 0 && !overlap
+	    && write_checkpoint(checkpoint, from, to, count, 0, NULL, 0) == 0) {
+	free(buf);
+	return 0;
+    }
+    since = 0;
+    while (done < count) {
+	n = (count - done < RELOCATE_CHUNK)? count - done: RELOCATE_CHUNK;
+	offset = (backwards)? count - done - n: done;
+	if (overlap) {
+	    if (read_blocks(fd, from + offset, buf, n, 0) == 0
+		    || write_checkpoint(checkpoint, from, to, count, done,
+			buf, n) == 0
+		    || write_blocks(fd, to + offset, buf, n) == 0
+		    || fdatasync(fd) < 0) {
+		error(errno, "can't copy blocks %u to %u", from + offset,
+			to + offset);
+		free(buf);
+		return 0;
+	    }
+	    done += n;
+	    continue;
+	}
+	if (since + n > CHECKPOINT_SPAN) {
+	    if (fdatasync(fd) < 0 || write_checkpoint(checkpoint, from, to,
+		    count, done, NULL, 0) == 0) {
+		free(buf);
+		return 0;
+	    }
+	    since = 0;
+	}
+	if (copy_range(fd, regular_file, from + offset, to + offset, n,
+		buf) == 0) {
+	    error(errno, "can't copy blocks %u to %u", from + offset,
+		    to + offset);
+	    free(buf);
+	    return 0;
+	}
+	done += n;
+	since += n;
+    }
+    free(buf);
+    if (fdatasync(fd) < 0) {
+	error(errno, "can't flush the copied blocks");
+	return 0;
+    }
+    return write_checkpoint(checkpoint, from, to, count, count, NULL, 0);
+}
+
+
+//
+// Where the partition of entry can be length blocks long: where it is
+// if the free space after it allows, else slid back over the free
+// space before it, else the first aligned place in free space.  Returns
+// 0 if there is no such place.
+//
+uint32_t
+choose_base(partition_map *entry, uint32_t length)
+{
+    partition_map *prev;
+    partition_map *next;
+    partition_map *cur;
+    uint64_t start;
+    uint64_t room;
+
+    start = entry->data->dpme_pblock_start;
+    room = entry->data->dpme_pblocks;
+    next = entry->next_by_base;
+    if (next != NULL
+	    && strncmp(next->data->dpme_type, kFreeType, DPISTRLEN) == 0) {
+	room += next->data->dpme_pblocks;
+    }
+    if (room >= length) {
+	return start;
+    }
+    prev = entry->prev_by_base;
+    if (prev != NULL
+	    && strncmp(prev->data->dpme_type, kFreeType, DPISTRLEN) == 0
+	    && room + prev->data->dpme_pblocks >= length) {
+	return prev->data->dpme_pblock_start;
+    }
+    for (cur = entry->the_map->base_order; cur != NULL;
+	    cur = cur->next_by_base) {
+	start = align_block(cur->data->dpme_pblock_start, entry->the_map);
+	if (strncmp(cur->data->dpme_type, kFreeType, DPISTRLEN) == 0
+		&& start + length <= (uint64_t) cur->data->dpme_pblock_start
+		    + cur->data->dpme_pblocks) {
+	    return start;
+	}
+    }
+    return 0;
+}
+
+
+//
+// Move partition index of name to base (if base >= 0) and make it
+// length blocks long (if length > 0), copying its contents, then
+// write the map.  The file system in it is not resized.  Returns 1 on
+// success.
+//
+int
+move_partition(char *name, long index, long base, long length)
+{
+    partition_map_header *map;
+    partition_map * entry;
+    char *checkpoint;
+    uint32_t old_start;
+    uint32_t old_length;
+    uint32_t count;
+    int junk;
+    int result;
+
+    map = open_partition_map(name, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    if (!map->writeable) {
+	error(-1, "can't write the map on '%s'", name);
+	close_partition_map(map);
+	return 0;
+    }
+    entry = find_entry_by_disk_address(index, map);
+    if (entry == NULL) {
+	error(-1, "'%s' has no partition %ld", name, index);
+	close_partition_map(map);
+	return 0;
+    }
+    old_start = entry->data->dpme_pblock_start;
+    old_length = entry->data->dpme_pblocks;
+    if (length <= 0) {
+	length = old_length;
+    }
+    if (base < 0) {
+	base = choose_base(entry, length);
+	if (base == 0) {
+	    error(-1, "no free space for %ld blocks on '%s'", length, name);
+	    close_partition_map(map);
+	    return 0;
+	}
+    }
+    if (base == old_start && length == old_length) {
+	printf("%s%ld is already %ld blocks at %ld\n", name, index, length,
+		base);
+	close_partition_map(map);
+	return 1;
+    }
+    if (relocate_entry(entry, base, length) == NULL) {
+	error(-1, "can't place partition %ld at %ld for %ld blocks",
+		index, base, length);
+	close_partition_map(map);
+	return 0;
+    }
+
+    checkpoint = checkpoint_path(name);
+    if (checkpoint == NULL) {
+	close_partition_map(map);
+	return 0;
+    }
+
+    count = (length < old_length)? length: old_length;
+    result = 1;
+    if (base != old_start) {
+	printf("Copying %u blocks from %u to %ld\n", count, old_start, base);
+	result = copy_blocks(map->fd, map->regular_file, old_start, base,
+		count, checkpoint);
+    }
+    if (result) {
+	result = write_partition_map(map);
+	if (result && base != old_start) {
+	    unlink(checkpoint);
+	}
+    }
+    if (checkpoint != checkpoint_file) {
+	free(checkpoint);
+    }
+    close_partition_map(map);
+    return result;
+}
+
+
+int
+compare_relocations(const void *a, const void *b)
+{
+    const struct relocation *x = (const struct relocation *) a;
+    const struct relocation *y = (const struct relocation *) b;
+
+    return (x->index < y->index)? -1: (x->index > y->index);
+}
+
+
+//
+// Make the map of name new_size blocks long, moving the partitions in
+// the way, with their contents, into free space past the new end of
+// the map.  The map may be too small to describe the medium part way
+// through, so everything is planned in memory, all the contents are
+// copied and the map is written once.  No copy's destination overlaps
+// any copy's source, so after an interruption a copy can be repeated
+// and the checkpoint only needs to say which copy was under way.
+// Returns 1 on success.
+//
+int
+grow_map(char *name, long new_size)
+{
+    partition_map_header *map;
+    partition_map * entry;
+    partition_map * cur;
+    struct relocation *list;
+    char *checkpoint;
+    uint64_t end;
+    uint64_t floor;
+    uint64_t base;
+    uint32_t done;
+    int limit;
+    int count;
+    int first;
+    int junk;
+    int result;
+    int i;
+
+    map = open_partition_map(name, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    if (!map->writeable) {
+	error(-1, "can't write the map on '%s'", name);
+	close_partition_map(map);
+	return 0;
+    }
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (strncmp(entry->data->dpme_type, kMapType, DPISTRLEN) == 0) {
+	    break;
+	}
+    }
+    if (entry == NULL || entry->data->dpme_pblock_start != 1) {
+	error(-1, "the map on '%s' does not start at block 1", name);
+	close_partition_map(map);
+	return 0;
+    }
+    if (new_size <= entry->data->dpme_pblocks) {
+	printf("The map on %s is already %u blocks\n", name,
+		entry->data->dpme_pblocks);
+	close_partition_map(map);
+	return 1;
+    }
+    end = 1 + (uint64_t) new_size;
+    if (end > map->media_size) {
+	error(-1, "a map of %ld blocks does not fit on '%s'", new_size, name);
+	close_partition_map(map);
+	return 0;
+    }
+
+    count = 0;
+    for (cur = entry->next_by_base; cur != NULL
+	    && cur->data->dpme_pblock_start < end; cur = cur->next_by_base) {
+	count++;
+    }
+    list = (struct relocation *) calloc(count + 1, sizeof(struct relocation));
+    if (list == NULL) {
+	error(errno, "can't allocate memory for relocations");
+	close_partition_map(map);
+	return 0;
+    }
+	// what is in the way, and where free space may be taken from
+    count = 0;
+    floor = end;
+    for (cur = entry->next_by_base; cur != NULL
+	    && cur->data->dpme_pblock_start < end; cur = cur->next_by_base) {
+	if (strncmp(cur->data->dpme_type, kFreeType, DPISTRLEN) != 0) {
+	    list[count].index = cur->disk_address;
+	    list[count].from = cur->data->dpme_pblock_start;
+	    list[count].count = cur->data->dpme_pblocks;
+	    count++;
+	    base = (uint64_t) cur->data->dpme_pblock_start
+		    + cur->data->dpme_pblocks;
+	    if (base > floor) {
+		floor = base;
+	    }
+	}
+    }
+
+	// the map may hold more entries than it has room for until it
+	// is grown
+    limit = map->maximum_in_map;
+    map->maximum_in_map = -1;
+    result = 1;
+    for (i = 0; result && i < count; i++) {
+	list[i].to = 0;
+	for (cur = map->base_order; cur != NULL; cur = cur->next_by_base) {
+	    base = cur->data->dpme_pblock_start;
+	    if (base < floor) {
+		base = floor;
+	    }
+	    base = align_block(base, map);
+	    if (strncmp(cur->data->dpme_type, kFreeType, DPISTRLEN) == 0
+		    && base + list[i].count <= (uint64_t)
+			cur->data->dpme_pblock_start + cur->data->dpme_pblocks) {
+		list[i].to = base;
+		break;
+	    }
+	}
+	cur = find_entry_by_sector(list[i].from, map);
+	if (list[i].to != 0) {
+	    list[i].entry = relocate_entry(cur, list[i].to, list[i].count);
+	}
+	if (list[i].entry == NULL) {
+	    error(-1, "no free space to move partition %ld (%u blocks) to",
+		    list[i].index, list[i].count);
+	    result = 0;
+	}
+    }
+    if (result) {
+	resize_map(new_size, map);
+	entry = find_entry_by_sector(1, map);
+	if (entry == NULL || entry->data->dpme_pblocks != new_size) {
+	    result = 0;
+	} else if (map->blocks_in_map > new_size) {
+	    error(-1, "%d entries don't fit in a map of %ld blocks",
+		    map->blocks_in_map, new_size);
+	    result = 0;
+	}
+	    // moving and growing add free entries; keep the numbers
+	qsort(list, count, sizeof(struct relocation), compare_relocations);
+	for (i = 0; result && i < count; i++) {
+	    if (list[i].entry->disk_address != list[i].index) {
+		move_entry_in_map(list[i].entry->disk_address, list[i].index,
+			map);
+	    }
+	}
+    }
+    if (result == 0) {
+	map->maximum_in_map = limit;
+	free(list);
+	close_partition_map(map);
+	return 0;
+    }
+
+    checkpoint = checkpoint_path(name);
+    if (checkpoint == NULL) {
+	free(list);
+	close_partition_map(map);
+	return 0;
+    }
+	// the copies before the one the checkpoint is for are done
+    first = 0;
+    for (i = 0; i < count; i++) {
+	if (read_checkpoint(checkpoint, list[i].from, list[i].to,
+		list[i].count, &done, NULL, NULL) == 1) {
+	    first = i;
+	    break;
+	}
+    }
+    for (i = first; result && i < count; i++) {
+	printf("Moving partition %ld: copying %u blocks from %u to %u\n",
+		list[i].index, list[i].count, list[i].from, list[i].to);
+	result = copy_blocks(map->fd, map->regular_file, list[i].from,
+		list[i].to, list[i].count, checkpoint);
+	if (result && i + 1 < count) {
+	    unlink(checkpoint);
+	}
+    }
+    if (result) {
+	result = write_partition_map(map);
+	if (result && count > 0) {
+	    unlink(checkpoint);
+	}
+    }
+    if (checkpoint != checkpoint_file) {
+	free(checkpoint);
+    }
+    free(list);
+    close_partition_map(map);
+    return result;
+}
+
+
+//
+// Make the map of name cover the whole medium, by growing the last
+// free entry, or the partition which if it is the last one, up to the
+// end of it.  Returns 1 on success.
+//
+int
+fill_medium(char *name, char *which)
+{
+    partition_map_header *map;
+    partition_map * entry;
+    partition_map * last;
+    partition_map * cur;
+    uint32_t covered;
+    int junk;
+    int result;
+
+    map = open_partition_map(name, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    if (!map->writeable) {
+	error(-1, "can't write the map on '%s'", name);
+	close_partition_map(map);
+	return 0;
+    }
+    last = map->base_order;
+    if (last == NULL) {
+	error(-1, "no partition map on '%s'", name);
+	close_partition_map(map);
+	return 0;
+    }
+    while (last->next_by_base != NULL) {
+	last = last->next_by_base;
+    }
+    covered = last->data->dpme_pblock_start + last->data->dpme_pblocks;
+    if (covered > map->media_size) {
+	error(-1, "the map on '%s' covers %u blocks but the medium has only %u",
+		name, covered, map->media_size);
+	close_partition_map(map);
+	return 0;
+    }
+
+    entry = NULL;
+    if (which != NULL) {
+	entry = find_partition(map, which);
+	if (entry == NULL) {
+	    close_partition_map(map);
+	    return 0;
+	}
+	for (cur = entry->next_by_base; cur != NULL; cur = cur->next_by_base) {
+	    if (strncmp(cur->data->dpme_type, kFreeType, DPISTRLEN) != 0) {
+		error(-1, "partition %ld is not the last one on '%s'",
+			entry->disk_address, name);
+		close_partition_map(map);
+		return 0;
+	    }
+	}
+    }
+    if (covered == map->media_size
+	    && (entry == NULL || entry == last)
+	    && (map->misc == NULL || map->misc->sbSig != BLOCK0_SIGNATURE
+		|| map->misc->sbBlkCount == map->media_size)) {
+	printf("The map on %s already covers all %u blocks\n", name,
+		map->media_size);
+	close_partition_map(map);
+	return 1;
+    }
+
+    if (entry != NULL && entry == last) {
+	    // nothing after it, so no free entry is needed to grow into
+	if (entry->data->dpme_lblocks == entry->data->dpme_pblocks) {
+	    entry->data->dpme_lblocks = map->media_size
+		    - entry->data->dpme_pblock_start;
+	}
+	entry->data->dpme_pblocks = map->media_size
+		- entry->data->dpme_pblock_start;
+	result = set_media_size(map->media_size, map);
+    } else {
+	result = set_media_size(map->media_size, map);
+	if (result && entry != NULL) {
+	    result = (relocate_entry(entry, entry->data->dpme_pblock_start,
+		    map->media_size - entry->data->dpme_pblock_start) != NULL);
+	}
+    }
+    if (result) {
+	result = write_partition_map(map);
+    }
+    if (result) {
+	printf("The map on %s now covers all %u blocks\n", name,
+		map->media_size);
+    }
+    close_partition_map(map);
+    return result;
+}
+
+
+//
+// Cut the image file name off after its last partition that is not
+// free, dropping the trailing free entry and updating block zero to
+// match.  The map is written before the file is truncated, so an
+// interruption leaves a map that is merely smaller than the file.
+// Returns 1 on success.
+//
+int
+shrink_image(char *name)
+{
+    partition_map_header *map;
+    partition_map * entry;
+    uint64_t end;
+    uint32_t new_size;
+    int junk;
+    int result;
+
+    map = open_partition_map(name, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    if (!map->writeable || !map->regular_file) {
+	error(-1, "can't shrink '%s', it is not a writable image file", name);
+	close_partition_map(map);
+	return 0;
+    }
+    new_size = 1;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) != 0) {
+	    end = (uint64_t) entry->data->dpme_pblock_start
+		    + entry->data->dpme_pblocks;
+	    if (end > map->media_size) {
+		error(-1, "partition %ld runs past the end of '%s'",
+			entry->disk_address, name);
+		close_partition_map(map);
+		return 0;
+	    }
+	    if (end > new_size) {
+		new_size = end;
+	    }
+	}
+    }
+    if (new_size >= map->media_size) {
+	printf("%s has no free space at the end\n", name);
+	close_partition_map(map);
+	return 1;
+    }
+
+    result = set_media_size(new_size, map);
+    if (result) {
+	result = write_partition_map(map);
+    }
+    if (result && ftruncate(map->fd, (off_t) new_size * PBLOCK_SIZE) < 0) {
+	error(errno, "can't truncate '%s'", name);
+	result = 0;
+    }
+    if (result) {
+	printf("%s is now %u blocks (%llu bytes)\n", name, new_size,
+		(unsigned long long) new_size * PBLOCK_SIZE);
+    }
+    close_partition_map(map);
+    return result;
+}
+
+
+//
+// Compact the map of name, and with shrink cut it down to its entries,
+// then write it.  Returns 1 on success.
+//
+int
+compact_map(char *name, int shrink)
+{
+    partition_map_header *map;
+    int before;
+    int junk;
+    int result;
+
+    map = open_partition_map(name, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    if (!map->writeable) {
+	error(-1, "can't write the map on '%s'", name);
+	close_partition_map(map);
+	return 0;
+    }
+    before = map->blocks_in_map;
+    if (compact_partition_map(map, shrink) == 0) {
+	printf("The map on %s is already compact\n", name);
+	close_partition_map(map);
+	return 1;
+    }
+    result = write_partition_map(map);
+    if (result) {
+	printf("The map on %s now has %d entries in base order (was %d)\n",
+		name, map->blocks_in_map, before);
+    }
+    close_partition_map(map);
+    return result;
+}
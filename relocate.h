@@ -0,0 +1,38 @@
+//
+// relocate.h - move and resize partitions along with their contents
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+extern char *checkpoint_file;
+
+
+//
+// Forward declarations
+//
+int compact_map(char *name, int shrink);
+int copy_blocks(int fd, int regular_file, uint32_t from, uint32_t to,
+	uint32_t count, const char *checkpoint);
+int fill_medium(char *name, char *which);
+int grow_map(char *name, long new_size);
+int move_partition(char *name, long index, long base, long length);
+int parse_blocks(const char *arg, long *value);
+int parse_relocation(const char *arg, long *index, long *value);
+int shrink_image(char *name);
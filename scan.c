@@ -0,0 +1,237 @@
+//
+// scan.c - catalog the partition maps of a tree of disk images
+//
+// The tree is walked once to collect candidate files, then the files
+// are handed to the work stealing pool.  Each worker formats its rows
+// into a buffer of its own and only takes the output lock to flush.
+// Only block zero and the map blocks of each image are read.
+//
+
+#define _XOPEN_SOURCE 700	// for nftw
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "output.h"
+#include "pool.h"
+#include "scan.h"
+
+
+//
+// Defines
+//
+#define SCAN_FLUSH	(32*1024)
+#define SCAN_FDS	64
+
+
+//
+// Types
+//
+struct scan_job {
+    char **paths;
+    long count;
+    long size;
+    output_buffer **buffers;
+    pthread_mutex_t out_lock;
+    long mapped;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+static struct scan_job *walk_job;	// nftw() has no user argument
+
+
+//
+// Forward declarations
+//
+int add_scan_path(struct scan_job *job, const char *path);
+void scan_image(long task, int worker, void *arg);
+int scan_tree_entry(const char *path, const struct stat *sb, int type,
+	struct FTW *ftw);
+
+
+//
+// Routines
+//
+int
+add_scan_path(struct scan_job *job, const char *path)
+{
+    char **p;
+
+    if (job->count >= job->size) {
+	job->size = (job->size == 0)? 1024: job->size * 2;
+	p = (char **) realloc(job->paths, job->size * sizeof(char *));
+	if (p == NULL) {
+	    error(errno, "can't allocate memory for scan list");
+	    return 0;
+	}
+	job->paths = p;
+    }
+    job->paths[job->count] = strdup(path);
+    if (job->paths[job->count] == NULL) {
+	error(errno, "can't allocate memory for scan list");
+	return 0;
+    }
+    job->count++;
+    return 1;
+}
+
+
+int
+scan_tree_entry(const char *path, const struct stat *sb, int type,
+	struct FTW *ftw)
+{
+    if (type == FTW_F && (S_ISBLK(sb->st_mode)
+	    || (S_ISREG(sb->st_mode) && sb->st_size >= 2 * PBLOCK_SIZE))) {
+	if (add_scan_path(walk_job, path) == 0) {
+	    return 1;
+	}
+    } else if (type == FTW_DNR) {
+	error(errno, "can't read directory '%s'", path);
+    }
+    return 0;
+}
+
+
+void
+scan_image(long task, int worker, void *arg)
+{
+    struct scan_job *job = (struct scan_job *) arg;
+    output_buffer *ob = job->buffers[worker];
+    partition_map_header *map;
+    partition_map * entry;
+    DPME *p;
+    unsigned long free_blocks;
+    int drivers;
+    int junk;
+
+    map = open_partition_map(job->paths[task], &junk);
+    if (map == NULL) {
+	return;
+    }
+    __sync_fetch_and_add(&job->mapped, 1);
+
+    free_blocks = 0;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) == 0) {
+	    free_blocks += entry->data->dpme_pblocks;
+	}
+    }
+    drivers = 0;
+    if (map->misc->sbSig == BLOCK0_SIGNATURE) {
+	drivers = map->misc->sbDrvrCount;
+    }
+
+    for (entry = map->disk_order; entry != NULL; entry = entry->next_on_disk) {
+	p = entry->data;
+	out_begin_record(ob, "partition");
+	out_text_field(ob, "image", map->name, strlen(map->name));
+	out_number_field(ob, "index", entry->disk_address);
+	out_text_field(ob, "type", p->dpme_type, DPISTRLEN);
+	out_text_field(ob, "name", p->dpme_name, DPISTRLEN);
+	out_number_field(ob, "base", p->dpme_pblock_start);
+	out_number_field(ob, "length", p->dpme_pblocks);
+	out_number_field(ob, "free_blocks", free_blocks);
+	out_number_field(ob, "drivers", drivers);
+	out_end_record(ob);
+    }
+    close_partition_map(map);
+
+    if (ob->len >= SCAN_FLUSH) {
+	pthread_mutex_lock(&job->out_lock);
+	flush_output(ob);
+	pthread_mutex_unlock(&job->out_lock);
+    }
+}
+
+
+//
+// Catalog every image under the given directories (or the named images
+// themselves) on up to workers threads.  Rows go to standard output as
+// TSV unless JSON was asked for.  Returns the number of images that
+// held a partition map, or -1 if the walk failed.
+//
+long
+scan_images(char **names, int count, int workers)
+{
+    struct scan_job job;
+    struct stat info;
+    long i;
+    int result = 0;
+
+    job.paths = NULL;
+    job.count = 0;
+    job.size = 0;
+    job.mapped = 0;
+    walk_job = &job;
+    for (i = 0; i < count; i++) {
+	if (stat(names[i], &info) < 0) {
+	    error(errno, "can't stat '%s'", names[i]);
+	    result = -1;
+	} else if (!S_ISDIR(info.st_mode)) {
+	    if (add_scan_path(&job, names[i]) == 0) {
+		result = -1;
+	    }
+	} else if (nftw(names[i], scan_tree_entry, SCAN_FDS, FTW_PHYS) != 0) {
+	    error(errno, "can't walk '%s'", names[i]);
+	    result = -1;
+	}
+    }
+    walk_job = NULL;
+
+    if (output_format == kTextFormat) {
+	output_format = kTSVFormat;
+    }
+    if (workers <= 0) {
+	workers = default_pool_size();
+    }
+    job.buffers = (output_buffer **) calloc(workers, sizeof(output_buffer *));
+    if (job.buffers == NULL) {
+	error(errno, "can't allocate memory for scan buffers");
+	result = -1;
+    } else {
+	for (i = 0; i < workers; i++) {
+	    if ((job.buffers[i] = new_output_buffer(1)) == NULL) {
+		workers = i;
+		break;
+	    }
+	}
+	pthread_mutex_init(&job.out_lock, NULL);
+
+	if (workers > 0) {
+	    fflush(stdout);
+	    run_pool(job.count, workers, scan_image, &job);
+	}
+
+	for (i = 0; i < workers; i++) {
+	    free_output_buffer(job.buffers[i]);
+	}
+	pthread_mutex_destroy(&job.out_lock);
+	free(job.buffers);
+    }
+
+    for (i = 0; i < job.count; i++) {
+	free(job.paths[i]);
+    }
+    free(job.paths);
+    if (result < 0) {
+	return result;
+    }
+    return job.mapped;
+}
@@ -0,0 +1,29 @@
+//
+// scan.h - catalog the partition maps of a tree of disk images
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+long scan_images(char **names, int count, int workers);
@@ -0,0 +1,304 @@
+//
+// sparse.c - make disk image files sparse
+//
+// The image is read in large chunks and every file system block that
+// is all zero is deallocated with FALLOC_FL_PUNCH_HOLE, adjacent ones
+// in a single call.  Holes that are already there are skipped without
+// reading them (SEEK_DATA).  Optionally the Apple_Free extents of the
+// map are deallocated whatever they hold and never read.
+//
+
+#define _GNU_SOURCE	// for fallocate and SEEK_DATA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "sparse.h"
+
+
+//
+// Defines
+//
+#define SPARSE_CHUNK	(4*1024*1024)
+
+
+//
+// Types
+//
+typedef uint64_t zero_vector __attribute__((vector_size(16)));
+
+struct sparse_state {
+    int fd;
+    off_t hole_start;		// start of the pending run, or -1
+    off_t hole_end;
+    long holes;
+    off_t punched;
+};
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int add_hole(struct sparse_state *s, off_t start, off_t end);
+int flush_hole(struct sparse_state *s);
+int sparsify_range(struct sparse_state *s, char *buf, off_t start, off_t end,
+	long block);
+
+
+//
+// Routines
+//
+
+//
+// len must be a multiple of 64 and p 16 byte aligned.  The vector
+// type lets the compiler use whatever SIMD registers the target has.
+//
+int
+is_zero_block(const void *p, size_t len)
+{
+    const zero_vector *v = (const zero_vector *) p;
+    zero_vector acc0 = {0, 0};
+    zero_vector acc1 = {0, 0};
+    zero_vector acc2 = {0, 0};
+    zero_vector acc3 = {0, 0};
+    size_t i;
+
+    for (i = 0; i < len / sizeof(zero_vector); i += 4) {
+	acc0 |= v[i];
+	acc1 |= v[i + 1];
+	acc2 |= v[i + 2];
+	acc3 |= v[i + 3];
+    }
+    acc0 |= acc1 | acc2 | acc3;
+    return (acc0[0] | acc0[1]) == 0;
+}
+
+
+int
+flush_hole(struct sparse_state *s)
+{
+    off_t len;
+
+    if (s->hole_start < 0) {
+	return 1;
+    }
+    len = s->hole_end - s->hole_start;
+    if (fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    s->hole_start, len) < 0) {
+	error(errno, "can't deallocate bytes %lld to %lld",
+		(long long) s->hole_start, (long long) s->hole_end - 1);
+	return 0;
+    }
+    s->holes++;
+    s->punched += len;
+    s->hole_start = -1;
+    return 1;
+}
+
+
+//
+// Extend the pending run or start a new one.
+//
+int
+add_hole(struct sparse_state *s, off_t start, off_t end)
+{
+    if (s->hole_start >= 0 && start == s->hole_end) {
+	s->hole_end = end;
+	return 1;
+    }
+    if (flush_hole(s) == 0) {
+	return 0;
+    }
+    s->hole_start = start;
+    s->hole_end = end;
+    return 1;
+}
+
+
+//
+// Punch the zero blocks between start and end, which are multiples
+// of block.
+//
+int
+sparsify_range(struct sparse_state *s, char *buf, off_t start, off_t end,
+	long block)
+{
+    off_t data;
+    off_t hole;
+    off_t pos;
+    size_t len;
+    size_t i;
+    ssize_t t;
+
+    pos = start;
+    while (pos < end) {
+	    // skip what is already a hole
+	data = lseek(s->fd, pos, SEEK_DATA);
+	if (data < 0 || data >= end) {
+	    break;
+	}
+	hole = lseek(s->fd, data, SEEK_HOLE);
+	if (hole < 0 || hole > end) {
+	    hole = end;
+	}
+	pos = data - data % block;
+
+	while (pos < hole) {
+	    len = (hole - pos < SPARSE_CHUNK)? hole - pos: SPARSE_CHUNK;
+	    len -= len % block;
+	    if (len == 0) {
+		len = block;
+	    }
+	    t = pread(s->fd, buf, len, pos);
+	    if (t < 0 && errno == EINTR) {
+		continue;
+	    }
+	    if (t <= 0) {
+		error((t < 0)? errno: 0, "can't read at byte %lld",
+			(long long) pos);
+		return 0;
+	    }
+	    if (t % block != 0) {
+		// short read at the end of the file
+		memset(buf + t, 1, block - t % block);
+		t += block - t % block;
+	    }
+	    for (i = 0; i < (size_t) t; i += block) {
+		if (is_zero_block(buf + i, block)
+			&& add_hole(s, pos + i, pos + i + block) == 0) {
+		    return 0;
+		}
+	    }
+	    pos += t;
+	}
+    }
+    return flush_hole(s);
+}
+
+
+//
+// Deallocate the zero blocks of the image file name, and if free_too
+// the Apple_Free extents of its map.  Returns 1 on success.
+//
+int
+sparsify_image(char *name, int free_too)
+{
+    partition_map_header *map;
+    partition_map * entry;
+    struct sparse_state s;
+    struct stat info;
+    char *buf;
+    off_t pos;
+    off_t start;
+    off_t end;
+    long block;
+    int junk;
+    int result;
+
+    if (rflag) {
+	error(-1, "can't sparsify '%s' in read-only mode", name);
+	return 0;
+    }
+    s.fd = open_device(name, O_RDWR);
+    if (s.fd < 0) {
+	error(errno, "can't open file '%s' for writing", name);
+	return 0;
+    }
+    if (fstat(s.fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+	error(-1, "'%s' is not an image file", name);
+	close_device(s.fd);
+	return 0;
+    }
+    block = info.st_blksize;
+    if (block < PBLOCK_SIZE || block % 64 != 0 || block > SPARSE_CHUNK) {
+	block = 4096;
+    }
+    s.hole_start = -1;
+    s.holes = 0;
+    s.punched = 0;
+
+    map = NULL;
+    if (free_too) {
+	map = open_partition_map(name, &junk);
+	if (map == NULL) {
+	    close_device(s.fd);
+	    return 0;
+	}
+    }
+    if (posix_memalign((void **)&buf, 4096, SPARSE_CHUNK) != 0) {
+	error(errno, "can't allocate memory for disk buffers");
+	close_partition_map(map);
+	close_device(s.fd);
+	return 0;
+    }
+
+	// scan between the free extents, which go as they are
+    result = 1;
+    pos = 0;
+    entry = (map != NULL)? map->base_order: NULL;
+    for (;;) {
+	while (entry != NULL
+		&& strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) != 0) {
+	    entry = entry->next_by_base;
+	}
+	if (entry != NULL) {
+	    start = (off_t) entry->data->dpme_pblock_start * PBLOCK_SIZE;
+	    end = start + (off_t) entry->data->dpme_pblocks * PBLOCK_SIZE;
+	    if (end > info.st_size) {
+		end = info.st_size;
+	    }
+	} else {
+	    start = info.st_size;
+	    end = info.st_size;
+	}
+	if (start > pos) {
+	    // whole blocks only; the partial ones at the ends are scanned
+	    if (sparsify_range(&s, buf, pos - pos % block,
+		    start + (block - start % block) % block, block) == 0) {
+		result = 0;
+		break;
+	    }
+	}
+	if (end > start && (add_hole(&s, start, end) == 0
+		|| flush_hole(&s) == 0)) {
+	    result = 0;
+	    break;
+	}
+	if (entry == NULL) {
+	    break;
+	}
+	pos = (end > pos)? end: pos;
+	entry = entry->next_by_base;
+    }
+
+    if (result) {
+	fstat(s.fd, &info);
+	printf("%s: %lld bytes punched in %ld ranges, "
+		"%lld of %lld bytes now allocated\n", name,
+		(long long) s.punched, s.holes,
+		(long long) info.st_blocks * 512, (long long) info.st_size);
+    }
+    free(buf);
+    close_partition_map(map);
+    close_device(s.fd);
+    return result;
+}
@@ -0,0 +1,30 @@
+//
+// sparse.h - make disk image files sparse
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int is_zero_block(const void *p, size_t len);
+int sparsify_image(char *name, int free_too);
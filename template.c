@@ -0,0 +1,473 @@
+//
+// template.c - capturing and stamping partition map templates
+//
+// A template is block zero followed by the map blocks exactly as they
+// sit on the medium, so a template is itself a (short) disk image and
+// can be listed with -l.  Stamping a template lays the whole map down
+// in one write, stretching the trailing free space to fit the target.
+//
+// Cloning a layout loads another medium's map the same way and then
+// scales it to the target: drivers, bootstraps and the map keep their
+// size and every other entry, free ones included, grows or shrinks in
+// proportion, so the partitions keep their order and share of the
+// space.  The scaled partitions are then fitted to the target's
+// alignment, as new partitions are, with the free entries taking up
+// the slack.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "template.h"
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+	// types whose size is fixed by what goes in them
+const char *kFixedTypes[] = {
+    "Apple_partition_map", "Apple_Driver", "Apple_FWDriver", "Apple_Patches",
+    "Apple_Bootstrap", NULL
+};
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int is_fixed_partition(partition_map *entry);
+int is_free_partition(partition_map *entry);
+uint64_t align_near(uint64_t block, uint64_t low, uint64_t high,
+	partition_map_header *map);
+char* read_template(char *file, long *count);
+int scale_layout(partition_map_header *map, uint32_t new_size);
+void set_extent(partition_map *entry, uint32_t start, uint32_t length);
+
+
+//
+// Routines
+//
+
+//
+// block rounded to the nearest multiple of the map's alignment that is
+// at least low and below high, or block itself if there is none.
+//
+uint64_t
+align_near(uint64_t block, uint64_t low, uint64_t high,
+	partition_map_header *map)
+{
+    uint64_t a;
+
+    a = (block + map->alignment / 2) / map->alignment * map->alignment;
+    if (a < low) {
+	a = align_block(low, map);
+    }
+    if (a >= high) {
+	a = (high - 1) / map->alignment * map->alignment;
+    }
+    if (a < low || a >= high) {
+	return block;
+    }
+    return a;
+}
+
+
+int
+capture_template(char *name, char *file)
+{
+    partition_map_header *map;
+    int junk;
+    char *buf;
+    long count;
+    size_t len;
+    ssize_t t;
+    int fd;
+    int result = 0;
+
+    map = open_partition_map(name, &junk);
+    if (map == NULL) {
+	return 0;
+    }
+    buf = stage_partition_map(map, &count);
+    if (buf == NULL) {
+	close_partition_map(map);
+	return 0;
+    }
+	// only block zero and the entries, not the zapped block
+    len = (map->blocks_in_map + 1) * PBLOCK_SIZE;
+
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	error(errno, "can't open template file '%s'", file);
+    } else {
+	if ((t = write(fd, buf, len)) != (ssize_t) len) {
+	    error((t<0?errno:0), "can't write template file '%s'", file);
+	} else {
+	    printf("Captured %d map entries from '%s' into '%s'\n",
+		    map->blocks_in_map, name, file);
+	    result = 1;
+	}
+	if (close(fd) < 0 && result) {
+	    error(errno, "can't write template file '%s'", file);
+	    result = 0;
+	}
+    }
+    free(buf);
+    close_partition_map(map);
+    return result;
+}
+
+
+//
+// Copy the map of source onto name, scaled to its size, in a single
+// write.  Only the map is copied, not what is in the partitions.
+// Returns 1 on success.
+//
+int
+clone_layout(char *source, char *name)
+{
+    partition_map_header *from;
+    partition_map_header *map;
+    char *buf;
+    long count;
+    int junk;
+    int fd;
+    int result = 0;
+
+    if (rflag) {
+	error(-1, "can't clone onto '%s' in read-only mode", name);
+	return 0;
+    }
+    from = open_partition_map(source, &junk);
+    if (from == NULL) {
+	return 0;
+    }
+    buf = stage_partition_map(from, &count);
+    close_partition_map(from);
+    if (buf == NULL) {
+	return 0;
+    }
+
+    fd = open_device(name, O_RDWR);
+    if (fd < 0) {
+	error(errno, "can't open file '%s' for writing", name);
+	free(buf);
+	return 0;
+    }
+    map = make_partition_map_header(name, fd, 1);
+    if (map == NULL) {
+	free(buf);
+	return 0;
+    }
+
+    if (load_partition_map(map, buf, count) < 0) {
+	error(-1, "can't load the map of '%s'", source);
+    } else if (scale_layout(map, map->media_size) == 0) {
+	// already reported
+    } else if (set_media_size(map->media_size, map) == 0) {
+	error(-1, "the layout of '%s' does not fit on '%s'", source, name);
+    } else {
+	printf("Cloning %d map entries from '%s' onto '%s' (%u blocks)\n",
+		map->blocks_in_map, source, name, map->media_size);
+	result = write_partition_map(map);
+    }
+    free(buf);
+    close_partition_map(map);
+    return result;
+}
+
+
+//
+// Drivers come as Apple_Driver, Apple_Driver43, Apple_Driver_ATA and
+// so on, so fixed types match as prefixes.
+//
+int
+is_fixed_partition(partition_map *entry)
+{
+    int i;
+
+    for (i = 0; kFixedTypes[i] != NULL; i++) {
+	if (strncmp(entry->data->dpme_type, kFixedTypes[i],
+		strlen(kFixedTypes[i])) == 0) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+
+int
+is_free_partition(partition_map *entry)
+{
+    return strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) == 0;
+}
+
+
+char *
+read_template(char *file, long *count)
+{
+    int fd;
+    struct stat info;
+    char *buf;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
+	error(errno, "can't open template file '%s'", file);
+	return NULL;
+    }
+    if (fstat(fd, &info) < 0) {
+	error(errno, "can't stat template file '%s'", file);
+	close(fd);
+	return NULL;
+    }
+    if (info.st_size < 2 * PBLOCK_SIZE || info.st_size % PBLOCK_SIZE != 0) {
+	error(-1, "'%s' is not a partition map template", file);
+	close(fd);
+	return NULL;
+    }
+    *count = info.st_size / PBLOCK_SIZE;
+
+    buf = (char *) malloc(info.st_size);
+    if (buf == NULL) {
+	error(errno, "can't allocate memory for template");
+    } else if (read_blocks(fd, 0, buf, *count, 0) == 0) {
+	free(buf);
+	buf = NULL;
+    }
+    close(fd);
+    return buf;
+}
+
+
+//
+// Stretch or shrink the entries that aren't fixed so that the map,
+// which must cover its blocks without gaps, ends at new_size.  Each
+// gets its share of the space, and then partitions that follow a free
+// entry start on the map's alignment and the other scaled partitions
+// are rounded to it, the free entries taking up the slack.  The last
+// scaled entry takes whatever is left.  Returns 1 on success.
+//
+int
+scale_layout(partition_map_header *map, uint32_t new_size)
+{
+    partition_map * entry;
+    partition_map * last;
+    partition_map * prev;
+    DDMap *m;
+    uint64_t *ideal;
+    uint64_t ideal_start;
+    uint64_t fixed;
+    uint64_t tail;
+    uint64_t old_space;
+    uint64_t new_space;
+    uint64_t used;
+    uint64_t start;
+    uint64_t end;
+    uint32_t old_start;
+    uint32_t pos;
+    char moved[sizeof(map->misc->sbMap) / sizeof(DDMap)];
+    long n;
+    int i;
+
+    fixed = 0;
+    tail = 0;
+    last = NULL;
+    pos = map->base_order->data->dpme_pblock_start;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (entry->data->dpme_pblock_start != pos) {
+	    error(-1, "the map has a gap or overlap at block %u", pos);
+	    return 0;
+	}
+	pos += entry->data->dpme_pblocks;
+	if (is_fixed_partition(entry)) {
+	    fixed += entry->data->dpme_pblocks;
+	    tail += entry->data->dpme_pblocks;
+	} else {
+	    last = entry;
+	    tail = 0;
+	}
+    }
+    old_space = pos - map->base_order->data->dpme_pblock_start - fixed;
+    new_space = (uint64_t) new_size - map->base_order->data->dpme_pblock_start;
+    if (last == NULL || new_space < fixed + (map->blocks_in_map - 1)) {
+	error(-1, "the layout does not fit in %u blocks", new_size);
+	return 0;
+    }
+    new_space -= fixed;
+
+    ideal = (uint64_t *) malloc(map->blocks_in_map * sizeof(uint64_t));
+    if (ideal == NULL) {
+	error(errno, "can't allocate memory for the layout");
+	return 0;
+    }
+    used = 0;
+    n = 0;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	ideal[n] = entry->data->dpme_pblocks;
+	if (!is_fixed_partition(entry)) {
+	    ideal[n] = ideal[n] * new_space / old_space;
+	    if (ideal[n] == 0) {
+		ideal[n] = 1;
+	    }
+	    used += ideal[n];
+	}
+	n++;
+    }
+    if (used > new_space) {
+	error(-1, "the layout does not fit in %u blocks", new_size);
+	free(ideal);
+	return 0;
+    }
+
+    memset(moved, 0, sizeof(moved));
+    prev = NULL;
+    n = 0;
+    pos = map->base_order->data->dpme_pblock_start;
+    ideal_start = pos;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	old_start = entry->data->dpme_pblock_start;
+	start = pos;
+	if (is_fixed_partition(entry)) {
+	    end = start + entry->data->dpme_pblocks;
+	} else {
+	    if (!is_free_partition(entry) && prev != NULL
+		    && is_free_partition(prev)) {
+		    // the free entry before takes up the slack
+		start = prev->data->dpme_pblock_start + 1;
+		if (ideal_start > start) {
+		    start = ideal_start;
+		}
+		start = align_near(start, prev->data->dpme_pblock_start + 1,
+			new_size - tail, map);
+		set_extent(prev, prev->data->dpme_pblock_start,
+			start - prev->data->dpme_pblock_start);
+	    }
+	    if (entry == last) {
+		end = new_size - tail;
+	    } else if (is_free_partition(entry)) {
+		    // rounding may have eaten into it; what follows settles it
+		end = start + ideal[n];
+		if (end >= new_size - tail) {
+		    end = new_size - tail - 1;
+		}
+	    } else {
+		end = align_near(start + ideal[n], start + 1, new_size - tail,
+			map);
+	    }
+	    if (end <= start || end > new_size - tail
+		    || (entry != last && end == new_size - tail)) {
+		error(-1, "the layout does not fit in %u blocks", new_size);
+		free(ideal);
+		return 0;
+	    }
+	}
+	set_extent(entry, start, end - start);
+
+	    // drivers are found through block zero too; each descriptor
+	    // moves once, as a new start may be another entry's old one
+	if (map->misc->sbSig == BLOCK0_SIGNATURE) {
+	    m = (DDMap *) map->misc->sbMap;
+	    for (i = 0; i < map->misc->sbDrvrCount
+		    && i < (int) sizeof(moved); i++) {
+		if (!moved[i] && m[i].ddBlock == old_start) {
+		    m[i].ddBlock = start;
+		    moved[i] = 1;
+		}
+	    }
+	}
+	pos = end;
+	ideal_start += ideal[n];
+	prev = entry;
+	n++;
+    }
+    free(ideal);
+    return 1;
+}
+
+
+//
+// Give entry a new extent, keeping its logical part where it fits.
+//
+void
+set_extent(partition_map *entry, uint32_t start, uint32_t length)
+{
+    DPME *data = entry->data;
+
+    data->dpme_pblock_start = start;
+    if (data->dpme_lblocks == data->dpme_pblocks
+	    || data->dpme_lblock_start >= length) {
+	data->dpme_lblock_start = 0;
+	data->dpme_lblocks = length;
+    } else if (data->dpme_lblock_start + data->dpme_lblocks > length) {
+	data->dpme_lblocks = length - data->dpme_lblock_start;
+    }
+    data->dpme_pblocks = length;
+}
+
+
+int
+stamp_template(char *file, char *name)
+{
+    partition_map_header *map;
+    char *buf;
+    long count;
+    int fd;
+    int result = 0;
+
+    if (rflag) {
+	error(-1, "can't stamp '%s' in read-only mode", name);
+	return 0;
+    }
+    buf = read_template(file, &count);
+    if (buf == NULL) {
+	return 0;
+    }
+
+    fd = open_device(name, O_RDWR);
+    if (fd < 0) {
+	error(errno, "can't open file '%s' for writing", name);
+	free(buf);
+	return 0;
+    }
+    map = make_partition_map_header(name, fd, 1);
+    if (map == NULL) {
+	free(buf);
+	return 0;
+    }
+
+    if (load_partition_map(map, buf, count) < 0) {
+	error(-1, "'%s' is not a partition map template", file);
+    } else if (set_media_size(map->media_size, map) == 0) {
+	error(-1, "template '%s' does not fit on '%s'", file, name);
+    } else {
+	printf("Stamping %d map entries from '%s' onto '%s' (%u blocks)\n",
+		map->blocks_in_map, file, name, map->media_size);
+	result = write_partition_map(map);
+    }
+    free(buf);
+    close_partition_map(map);
+    return result;
+}
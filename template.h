@@ -0,0 +1,31 @@
+//
+// template.h - capturing and stamping partition map templates
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+
+
+//
+// Forward declarations
+//
+int capture_template(char *name, char *file);
+int clone_layout(char *source, char *name);
+int stamp_template(char *file, char *name);
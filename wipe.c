@@ -0,0 +1,229 @@
+//
+// wipe.c - clear old volume signatures from new partitions
+//
+// A partition carved out of free space still holds whatever was there
+// before, and a stale HFS or ext superblock in it is taken at its word
+// by auto-mounters and by our own probes.  With --wipe-signatures the
+// places where volumes keep their signatures are zeroed when the map is
+// written: the first and last WIPE_BLOCKS blocks of every partition that
+// is new since the map was read, and the ext backup superblocks inside
+// it.  That is a few hundred KB per partition, all of it submitted as
+// one batch of writes from a single zero buffer.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "hfdisk.h"
+#include "io.h"
+#include "errors.h"
+#include "partition_map.h"
+#include "discard.h"
+#include "wipe.h"
+
+
+//
+// Defines
+//
+#define WIPE_BLOCKS	256		/* 128KB at each end */
+#define EXT_SB_BLOCKS	2		/* 1024 byte superblock */
+
+
+//
+// Types
+//
+struct wipe_list {
+    struct io_request *req;
+    int count;
+    int size;
+};
+
+
+//
+// Global Constants
+//
+	// groups that hold ext backup superblocks with sparse_super,
+	// which are 1 and the powers of 3, 5 and 7
+const uint32_t kExtBackupGroups[] = {
+    1, 3, 5, 7, 9, 25, 27, 49, 81, 125, 243, 343, 625, 729, 2187, 2401,
+    3125, 6561, 15625, 16807, 19683, 59049, 78125, 117649, 177147
+};
+
+
+//
+// Global Variables
+//
+int wipe_flag;
+
+
+//
+// Forward declarations
+//
+int add_wipe(struct wipe_list *w, char *zero, uint64_t block, uint64_t count);
+int is_new_partition(partition_map_header *map, partition_map *entry);
+int wipe_partition(struct wipe_list *w, char *zero, uint32_t base,
+	uint32_t length);
+
+
+//
+// Routines
+//
+int
+add_wipe(struct wipe_list *w, char *zero, uint64_t block, uint64_t count)
+{
+    struct io_request *p;
+
+    if (w->count >= w->size) {
+	w->size = (w->size == 0)? 64: w->size * 2;
+	p = (struct io_request *) realloc(w->req,
+		w->size * sizeof(struct io_request));
+	if (p == NULL) {
+	    error(errno, "can't allocate memory for wipe requests");
+	    return 0;
+	}
+	w->req = p;
+    }
+    p = &w->req[w->count++];
+    p->block = block;
+    p->count = count;
+    p->buf = zero;
+    return 1;
+}
+
+
+//
+// A partition is new unless some partition started at the same block
+// when the map was read; one that only changed its size or type keeps
+// its volume.  With no record of the map as read, as after
+// initializing it, every partition is new.
+//
+int
+is_new_partition(partition_map_header *map, partition_map *entry)
+{
+    uint32_t start;
+    long lo;
+    long hi;
+    long mid;
+
+    if (strncmp(entry->data->dpme_type, kFreeType, DPISTRLEN) == 0
+	    || strncmp(entry->data->dpme_type, kMapType, DPISTRLEN) == 0
+	    || entry->data->dpme_pblocks == 0) {
+	return 0;
+    }
+    start = entry->data->dpme_pblock_start;
+    lo = 0;
+    hi = map->allocated_count;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (map->allocated[mid].start < start) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return lo >= map->allocated_count || map->allocated[lo].start != start;
+}
+
+
+int
+wipe_partition(struct wipe_list *w, char *zero, uint32_t base,
+	uint32_t length)
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t head;
+    int i;
+
+    head = (length < WIPE_BLOCKS)? length: WIPE_BLOCKS;
+    if (add_wipe(w, zero, base, head) == 0) {
+	return 0;
+    }
+    if (length > head) {
+	size = length - head;
+	if (size > WIPE_BLOCKS) {
+	    size = WIPE_BLOCKS;
+	}
+	if (add_wipe(w, zero, (uint64_t) base + length - size, size) == 0) {
+	    return 0;
+	}
+    }
+	// backups are at the start of their group, whose size depends
+	// on the block size, so cover 1K, 2K and 4K blocks
+    for (size = 1024; size <= 4096; size *= 2) {
+	for (i = 0; i < sizeof(kExtBackupGroups) / sizeof(uint32_t); i++) {
+	    offset = (uint64_t) kExtBackupGroups[i] * 8 * size * size;
+	    if (size == 1024) {
+		offset += 1024;		// the first group starts at block 1
+	    }
+	    offset /= PBLOCK_SIZE;
+	    if (offset + EXT_SB_BLOCKS > length - head) {
+		break;
+	    }
+	    if (offset >= head
+		    && add_wipe(w, zero, base + offset, EXT_SB_BLOCKS) == 0) {
+		return 0;
+	    }
+	}
+    }
+    return 1;
+}
+
+
+//
+// Zero the signature areas of the partitions that are new since the
+// map was read.  Returns the number of partitions wiped, or -1 if a
+// write failed.
+//
+int
+wipe_new_partitions(partition_map_header *map)
+{
+    partition_map * entry;
+    struct wipe_list w;
+    char *zero;
+    int partitions;
+    int done;
+    int i;
+
+    if (posix_memalign((void **)&zero, 4096, WIPE_BLOCKS * PBLOCK_SIZE) != 0) {
+	error(errno, "can't allocate memory for disk buffers");
+	return -1;
+    }
+    memset(zero, 0, WIPE_BLOCKS * PBLOCK_SIZE);
+    memset(&w, 0, sizeof(w));
+
+    partitions = 0;
+    for (entry = map->base_order; entry != NULL; entry = entry->next_by_base) {
+	if (!is_new_partition(map, entry)
+		|| (uint64_t) entry->data->dpme_pblock_start
+		    + entry->data->dpme_pblocks > map->media_size) {
+	    continue;
+	}
+	if (wipe_partition(&w, zero, entry->data->dpme_pblock_start,
+		entry->data->dpme_pblocks) == 0) {
+	    partitions = -1;
+	    break;
+	}
+	partitions++;
+    }
+
+    if (partitions > 0) {
+	done = write_batch(map->fd, w.req, w.count);
+	if (done < w.count) {
+	    for (i = 0; i < w.count; i++) {
+		if (w.req[i].ok == 0) {
+		    error(-1, "can't wipe blocks %lu to %lu", w.req[i].block,
+			    w.req[i].block + w.req[i].count - 1);
+		}
+	    }
+	    partitions = -1;
+	} else {
+	    printf("Wiped old signatures from %d new partition%s.\n",
+		    partitions, (partitions == 1)? "": "s");
+	}
+    }
+    free(w.req);
+    free(zero);
+    return partitions;
+}
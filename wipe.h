@@ -0,0 +1,30 @@
+//
+// wipe.h - clear old volume signatures from new partitions
+//
+
+
+//
+// Defines
+//
+
+
+//
+// Types
+//
+
+
+//
+// Global Constants
+//
+
+
+//
+// Global Variables
+//
+extern int wipe_flag;
+
+
+//
+// Forward declarations
+//
+int wipe_new_partitions(partition_map_header *map);